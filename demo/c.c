@@ -1,40 +1,311 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "scanner.h"
 
-#ifdef DEBUG_PRINT_TOKENS
-#include <stdio.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <sched.h>
 #endif
 
 typedef struct
 {
+  const char *source;
   const char *start;
   const char *current;
+  const char *line_start;
+  const char *chunk_end; // NULL, unless scanning a chunk of a larger source.
   int line;
   bool is_first_on_line;
+  bool chunk_ends_in_string;
+  bool keep_comments;
+  ScanError last_error;
 } Scanner;
 
-Scanner scanner;
-static const char *first_source_char;
+// Thread-local, so that multiple threads can each scan their own source (or their own chunk of one source). Built into
+// a shared library, the default TLS model costs a call to __tls_get_addr() per access, which made scanning three times
+// slower. Initial-exec makes it a single %fs-relative load instead - the state is small enough for the static TLS
+// space even when the library is dlopen()ed.
+#if defined(__GNUC__)
+#define SCANNER_TLS_MODEL __attribute__((tls_model("initial-exec")))
+#else
+#define SCANNER_TLS_MODEL
+#endif
+
+static _Thread_local Scanner thread_scanner SCANNER_TLS_MODEL;
 
 void scanner_init(const char *source)
 {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+  Scanner *scanner = &thread_scanner;
+  scanner->source = source;
+  scanner->start = source;
+  scanner->current = source;
+  scanner->line_start = source;
+  scanner->chunk_end = NULL;
+  scanner->line = 1;
+  scanner->chunk_ends_in_string = false;
+  scanner->keep_comments = false;
+}
+
+void scanner_keep_comments(bool keep)
+{
+  thread_scanner.keep_comments = keep;
+}
+
+void scanner_init_chunk(const char *source, const char *chunk_start, const char *chunk_end, int line)
+{
+  Scanner *scanner = &thread_scanner;
+  if (chunk_start == source)
+  {
+    scanner_init(source);
+    scanner->chunk_end = chunk_end;
+    return;
+  }
+
+  // Start on the newline preceding the chunk, so the first token is flagged as first on its line - just like it
+  // would be in a serial scan.
+  scanner->source = source;
+  scanner->start = chunk_start - 1;
+  scanner->current = chunk_start - 1;
+  scanner->line_start = chunk_start;
+  scanner->chunk_end = chunk_end;
+  scanner->line = line - 1;
+  scanner->chunk_ends_in_string = false;
+  scanner->keep_comments = false;
+}
+
+void scanner_init_at(const char *source, const char *position, int line)
+{
+  Scanner *scanner = &thread_scanner;
+  scanner_init(source);
+  scanner->start = position;
+  scanner->current = position;
+  scanner->line = line;
+
+  while (scanner->line_start < position && position[-1] != '\n')
+  {
+    position--;
+  }
+  scanner->line_start = position;
+}
+
+const char *scanner_get_line_start_at(const char *source, const char *position)
+{
+  // Positions on the line this thread's scanner is currently on don't need to walk back. This keeps column lookups
+  // cheap when a caller (e.g. a language server emitting semantic tokens) asks for every token right after scanning it.
+  const Scanner *scanner = &thread_scanner;
+  if (scanner->source == source && position >= scanner->line_start && position <= scanner->current)
+  {
+    return scanner->line_start;
+  }
 
-  first_source_char = source;
+  while (position > source && position[-1] != '\n')
+  {
+    position--;
+  }
+  return position;
 }
 
 const char *scanner_get_line_start(Token token)
 {
-  const char *line_start = token.start;
-  while (line_start > first_source_char && line_start[-1] != '\n')
+  return scanner_get_line_start_at(thread_scanner.source, token.start);
+}
+
+// Whether the eight bytes starting at `bytes` are all ASCII.
+static bool is_ascii_word(const char *bytes)
+{
+  uint64_t word;
+  memcpy(&word, bytes, sizeof(word));
+  return (word & 0x8080808080808080ull) == 0;
+}
+
+// Number of UTF-16 code units (what LSP columns count) of the UTF-8 bytes in [start, end).
+static int utf16_length(const char *start, const char *end)
+{
+  int length = 0;
+  while (start < end)
+  {
+    // Pure ASCII is one code unit per byte - check eight bytes at a time.
+    if (end - start >= 8 && is_ascii_word(start))
+    {
+      start += 8;
+      length += 8;
+      continue;
+    }
+
+    uint8_t byte = (uint8_t)*start++;
+    if ((byte & 0xC0) != 0x80)
+    {
+      length++; // Continuation bytes don't add a code unit...
+    }
+    if (byte >= 0xF0)
+    {
+      length++; // ...but four-byte sequences need a surrogate pair.
+    }
+  }
+  return length;
+}
+
+int scanner_get_utf16_column(Token token)
+{
+  if (token.type == TOKEN_ERROR)
+  {
+    return -1; // Its start is the message, not a position in the source.
+  }
+  return utf16_length(scanner_get_line_start(token), token.start);
+}
+
+int scanner_get_utf16_column_at(const char *source, const char *position)
+{
+  return utf16_length(scanner_get_line_start_at(source, position), position);
+}
+
+const char *scanner_get_utf16_position(const char *line_start, int column)
+{
+  const char *line_end = strchr(line_start, '\n');
+  if (line_end == NULL)
+  {
+    line_end = line_start + strlen(line_start);
+  }
+
+  const char *current = line_start;
+  while (column > 0 && current < line_end)
+  {
+    if (column >= 8 && line_end - current >= 8 && is_ascii_word(current))
+    {
+      current += 8;
+      column -= 8;
+      continue;
+    }
+
+    uint8_t byte = (uint8_t)*current++;
+    column -= byte >= 0xF0 ? 2 : 1;
+    while (current < line_end && ((uint8_t)*current & 0xC0) == 0x80)
+    {
+      current++;
+    }
+  }
+  return current;
+}
+
+// Whether the bytes in [start, end) are all ASCII.
+static bool is_ascii(const char *start, const char *end)
+{
+  for (; end - start >= 8; start += 8)
+  {
+    if (!is_ascii_word(start))
+    {
+      return false;
+    }
+  }
+  for (; start < end; start++)
+  {
+    if ((uint8_t)*start >= 0x80)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void line_index_add(LineIndex *index, int start, bool ascii)
+{
+  if (index->count == index->capacity)
+  {
+    index->capacity = index->capacity < 64 ? 64 : index->capacity * 2;
+    index->starts = realloc(index->starts, sizeof(int) * index->capacity);
+    index->ascii = realloc(index->ascii, sizeof(bool) * index->capacity);
+    if (index->starts == NULL || index->ascii == NULL)
+    {
+      exit(1);
+    }
+  }
+
+  index->starts[index->count] = start;
+  index->ascii[index->count] = ascii;
+  index->count++;
+}
+
+void line_index_init(LineIndex *index, const char *source)
+{
+  index->source = source;
+  index->count = 0;
+  index->capacity = 0;
+  index->starts = NULL;
+  index->ascii = NULL;
+
+  const char *end = source + strlen(source);
+  for (const char *line_start = source;;)
+  {
+    const char *newline = memchr(line_start, '\n', end - line_start);
+    const char *line_end = newline != NULL ? newline : end;
+    line_index_add(index, (int)(line_start - source), is_ascii(line_start, line_end));
+    if (newline == NULL)
+    {
+      break;
+    }
+    line_start = newline + 1;
+  }
+
+  // The end marker, placed as if the source ended in a newline so every line's length is the distance to the next.
+  line_index_add(index, (int)(end - source) + 1, true);
+  index->count--;
+}
+
+void line_index_free(LineIndex *index)
+{
+  free(index->starts);
+  free(index->ascii);
+  index->starts = NULL;
+  index->ascii = NULL;
+  index->count = 0;
+  index->capacity = 0;
+}
+
+LspPosition line_index_get_position(const LineIndex *index, int offset)
+{
+  // Find the last line starting at or before the offset.
+  int low = 0;
+  int high = index->count - 1;
+  while (low < high)
+  {
+    int mid = low + (high - low + 1) / 2;
+    if (index->starts[mid] <= offset)
+    {
+      low = mid;
+    }
+    else
+    {
+      high = mid - 1;
+    }
+  }
+
+  const char *line_start = index->source + index->starts[low];
+  LspPosition position = {
+      .line = low,
+      .column = index->ascii[low] ? offset - index->starts[low] : utf16_length(line_start, index->source + offset),
+  };
+  return position;
+}
+
+int line_index_get_offset(const LineIndex *index, LspPosition position)
+{
+  int line = position.line < 0 ? 0 : position.line < index->count ? position.line : index->count - 1;
+  int column = position.column < 0 ? 0 : position.column;
+  int start = index->starts[line];
+  if (index->ascii[line])
   {
-    line_start--;
+    int length = index->starts[line + 1] - 1 - start;
+    return start + (column < length ? column : length);
   }
-  return line_start;
+  return (int)(scanner_get_utf16_position(index->source + start, column) - index->source);
 }
 
 static bool is_digit(char chr)
@@ -47,54 +318,187 @@ static bool is_alpha(char chr)
   return (chr >= 'a' && chr <= 'z') || (chr >= 'A' && chr <= 'Z') || chr == '_';
 }
 
-static bool is_at_end()
+static bool is_at_end(Scanner *scanner)
 {
-  return *scanner.current == '\0';
+  return *scanner->current == '\0';
 }
 
-static char advance()
+static char advance(Scanner *scanner)
 {
-  scanner.current++;
-  return scanner.current[-1];
+  scanner->current++;
+  return scanner->current[-1];
 }
 
-static char peek()
+static char peek(Scanner *scanner)
 {
-  return *scanner.current;
+  return *scanner->current;
 }
 
-static char peek_next()
+static char peek_next(Scanner *scanner)
 {
-  if (is_at_end())
+  if (is_at_end(scanner))
   {
     return '\0';
   }
-  return scanner.current[1];
+  return scanner->current[1];
 }
 
-static bool match(char expected)
+static bool match(Scanner *scanner, char expected)
 {
-  if (is_at_end())
+  if (is_at_end(scanner))
   {
     return false;
   }
 
-  if (*scanner.current != expected)
+  if (*scanner->current != expected)
   {
     return false;
   }
-  scanner.current++;
+  scanner->current++;
   return true;
 }
 
-static Token make_token(TokenKind type)
+// Most comments, string literals, indentation and numbers are short, so their first bytes are checked inline - a call
+// into libc costs more than a short run. Only longer ones call into libc, which picks the routine for the CPU once at
+// load time. In glibc on x86-64 that's an SSE2, AVX2 or EVEX variant for strchr, but only an SSE4.2 one for strcspn and
+// strspn. They also stop at the end of the source, which a word-at-a-time loop here couldn't, not knowing its length.
+#define INLINE_SCAN_BYTES 16
+
+// Process-wide, set once before scanning. Keeps the byte loops for benchmarking and differential testing.
+static bool force_scalar = false;
+
+void scanner_force_scalar(bool scalar)
+{
+  force_scalar = scalar;
+}
+
+// The part of comment_end for comments longer than INLINE_SCAN_BYTES. Kept apart, so the short part stays small
+// enough to be inlined.
+static const char *long_comment_end(const char *current)
+{
+  if (force_scalar)
+  {
+    while (*current != '\n' && *current != '\0')
+    {
+      current++;
+    }
+    return current;
+  }
+
+  const char *end = strchr(current, '\n');
+  return end != NULL ? end : current + strlen(current);
+}
+
+// Find the end of a line comment - its newline, or the end of the source.
+static inline const char *comment_end(const char *current)
+{
+  const char *start = current;
+  while (*current != '\n' && *current != '\0')
+  {
+    if (++current - start == INLINE_SCAN_BYTES)
+    {
+      return long_comment_end(current);
+    }
+  }
+  return current;
+}
+
+// The part of string_special_char for string literals longer than INLINE_SCAN_BYTES.
+static const char *long_string_special_char(const char *current)
+{
+  if (force_scalar)
+  {
+    while (*current != '"' && *current != '\\' && *current != '\n' && *current != '\0')
+    {
+      current++;
+    }
+    return current;
+  }
+
+  return current + strcspn(current, "\"\\\n");
+}
+
+// Find the next character in a string literal that needs handling - the closing quote, a backslash, a newline, or the
+// end of the source.
+static inline const char *string_special_char(const char *current)
+{
+  const char *start = current;
+  while (*current != '"' && *current != '\\' && *current != '\n' && *current != '\0')
+  {
+    if (++current - start == INLINE_SCAN_BYTES)
+    {
+      return long_string_special_char(current);
+    }
+  }
+  return current;
+}
+
+// The part of blank_end for runs longer than INLINE_SCAN_BYTES, i.e. deep indentation.
+static const char *long_blank_end(const char *current)
+{
+  if (force_scalar)
+  {
+    while (*current == ' ' || *current == '\r' || *current == '\t')
+    {
+      current++;
+    }
+    return current;
+  }
+
+  return current + strspn(current, " \r\t");
+}
+
+// Find the end of a run of whitespace other than newlines, which the scanner has to count.
+static inline const char *blank_end(const char *current)
+{
+  const char *start = current;
+  while (*current == ' ' || *current == '\r' || *current == '\t')
+  {
+    if (++current - start == INLINE_SCAN_BYTES)
+    {
+      return long_blank_end(current);
+    }
+  }
+  return current;
+}
+
+// The part of digits_end for runs longer than INLINE_SCAN_BYTES.
+static const char *long_digits_end(const char *current)
+{
+  if (force_scalar)
+  {
+    while (is_digit(*current))
+    {
+      current++;
+    }
+    return current;
+  }
+
+  return current + strspn(current, "0123456789");
+}
+
+// Find the end of a run of decimal digits.
+static inline const char *digits_end(const char *current)
+{
+  const char *start = current;
+  while (is_digit(*current))
+  {
+    if (++current - start == INLINE_SCAN_BYTES)
+    {
+      return long_digits_end(current);
+    }
+  }
+  return current;
+}
+
+static Token make_token(Scanner *scanner, TokenKind type)
 {
   Token token;
   token.type = type;
-  token.start = scanner.start;
-  token.length = (int)(scanner.current - scanner.start);
-  token.line = scanner.line;
-  token.is_first_on_line = scanner.is_first_on_line;
+  token.start = scanner->start;
+  token.length = (int)(scanner->current - scanner->start);
+  token.line = scanner->line;
+  token.is_first_on_line = scanner->is_first_on_line;
 
 #ifdef DEBUG_PRINT_TOKENS
   printf("TOKEN: %d %.*s\n", token.type, token.length, token.start);
@@ -103,42 +507,73 @@ static Token make_token(TokenKind type)
   return token;
 }
 
-static Token error_token(const char *message)
+#define ERROR_MESSAGE(message) {message, sizeof(message) - 1}
+
+// Messages are literals, so their lengths are known up front instead of calling strlen for every error.
+static const struct
+{
+  const char *message;
+  int length;
+} error_messages[] = {
+    [SCAN_ERROR_UNTERMINATED_STRING] = ERROR_MESSAGE("Unterminated string."),
+    [SCAN_ERROR_HEX_LITERAL] = ERROR_MESSAGE("Hexadecimal number literal must have at least one digit/letter and at "
+                                             "most " STR(MAX_HEX_DIGITS) "."),
+    [SCAN_ERROR_BINARY_LITERAL] = ERROR_MESSAGE("Binary number literal must have at least one digit and at "
+                                                "most " STR(MAX_BINARY_DIGITS) "."),
+    [SCAN_ERROR_OCTAL_LITERAL] = ERROR_MESSAGE("Octal number literal must have at least one digit and at "
+                                               "most " STR(MAX_OCTAL_DIGITS) "."),
+    [SCAN_ERROR_UNEXPECTED_CHAR] = ERROR_MESSAGE("Unexpected character."),
+};
+
+#undef ERROR_MESSAGE
+
+static Token error_token(Scanner *scanner, ScanErrorCode code)
 {
+  // The token carries the message, the offending source is recorded separately.
+  scanner->last_error.code = code;
+  scanner->last_error.start = scanner->start;
+  scanner->last_error.length = (int)(scanner->current - scanner->start);
+  // Only an unterminated string spans lines, and the scanner is on its last one by now. Report the one it starts on.
+  scanner->last_error.line = scanner->line;
+  for (const char *chr = scanner->start; chr < scanner->current; chr++)
+  {
+    scanner->last_error.line -= *chr == '\n';
+  }
+
   Token token;
   token.type = TOKEN_ERROR;
-  token.start = message;
-  token.length = (int)strlen(message);
-  token.line = scanner.line;
-  token.is_first_on_line = scanner.is_first_on_line;
+  token.start = error_messages[code].message;
+  token.length = error_messages[code].length;
+  token.line = scanner->line;
+  token.is_first_on_line = scanner->is_first_on_line;
   return token;
 }
 
-static void skip_whitespace()
+static void skip_whitespace(Scanner *scanner)
 {
   for (;;)
   {
-    char chr = peek();
+    char chr = peek(scanner);
     switch (chr)
     {
     case ' ':
     case '\r':
     case '\t':
-      advance();
+      advance(scanner);
       break;
     case '\n':
-      scanner.is_first_on_line = true;
-      scanner.line++;
-      advance();
+      scanner->is_first_on_line = true;
+      scanner->line++;
+      advance(scanner);
+      scanner->line_start = scanner->current;
+      // Long runs of whitespace are indentation, between tokens it's mostly a single space.
+      scanner->current = blank_end(scanner->current);
       break;
     case '/':
-      if (peek_next() == '/')
+      if (peek_next(scanner) == '/' && !scanner->keep_comments)
       {
         // A comment goes until the end of the line.
-        while (peek() != '\n' && !is_at_end())
-        {
-          advance();
-        }
+        scanner->current = comment_end(scanner->current);
       }
       else
       {
@@ -151,9 +586,9 @@ static void skip_whitespace()
   }
 }
 
-static TokenKind check_keyword(int start, int length, const char *rest, TokenKind type)
+static TokenKind check_keyword(Scanner *scanner, int start, int length, const char *rest, TokenKind type)
 {
-  if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0)
+  if (scanner->current - scanner->start == start + length && memcmp(scanner->start + start, rest, length) == 0)
   {
     return type;
   }
@@ -161,366 +596,1858 @@ static TokenKind check_keyword(int start, int length, const char *rest, TokenKin
   return TOKEN_ID;
 }
 
-static TokenKind identifier_type()
-{
-  switch (scanner.start[0])
-  {
-  case 'a':
-    return check_keyword(1, 2, "nd", TOKEN_AND);
-  case 'b':
-  {
-    if (scanner.current - scanner.start > 1)
-    {
-      switch (scanner.start[1])
-      {
-      case 'a':
-        return check_keyword(2, 2, "se", TOKEN_BASE);
-      case 'r':
-        return check_keyword(2, 3, "eak", TOKEN_BREAK);
-      }
-    }
-    break;
-  }
-  case 'c':
-  {
-    if (scanner.current - scanner.start > 1)
-    {
-      switch (scanner.start[1])
-      {
-      case 'a':
-        return check_keyword(2, 3, "tch", TOKEN_CATCH);
-      case 'l':
-        return check_keyword(2, 1, "s", TOKEN_CLASS);
-      case 'o':
-        return check_keyword(2, 3, "nst", TOKEN_CONST);
-      case 't':
-        return check_keyword(2, 2, "or", TOKEN_CTOR);
-      }
-    }
-    break;
-  }
-  case 'e':
-    if (scanner.current - scanner.start > 1)
-    {
-      switch (scanner.start[1])
-      {
-      case 'l':
-        return check_keyword(2, 2, "se", TOKEN_ELSE);
-      }
-    }
-    break;
-  case 'f':
-    if (scanner.current - scanner.start > 1)
-    {
-      switch (scanner.start[1])
-      {
-      case 'a':
-        return check_keyword(2, 3, "lse", TOKEN_FALSE);
-      case 'o':
-        return check_keyword(2, 1, "r", TOKEN_FOR);
-      case 'n':
-        return check_keyword(2, 0, "", TOKEN_FN);
-      case 'r':
-        return check_keyword(2, 2, "om", TOKEN_FROM);
-      }
-    }
-    break;
-  case 'i':
-    if (scanner.current - scanner.start > 1)
-    {
-      switch (scanner.start[1])
-      {
-      case 'f':
-        return check_keyword(2, 0, "", TOKEN_IF);
-      case 's':
-        return check_keyword(2, 0, "", TOKEN_IS);
-      case 'm':
-        return check_keyword(2, 4, "port", TOKEN_IMPORT);
-      case 'n':
-        return check_keyword(2, 0, "", TOKEN_IN);
-      }
-    }
-    break;
-  case 'n':
-    return check_keyword(1, 2, "il", TOKEN_NIL);
-  case 'o':
-    return check_keyword(1, 1, "r", TOKEN_OR);
-  case 'p':
-    return check_keyword(1, 4, "rint", TOKEN_PRINT);
-  case 'r':
-    return check_keyword(1, 2, "et", TOKEN_RETURN);
-  case 's':
-    if (scanner.current - scanner.start > 1)
-    {
-      switch (scanner.start[1])
-      {
-      case 'k':
-        return check_keyword(2, 2, "ip", TOKEN_SKIP);
-      case 't':
-        return check_keyword(2, 4, "atic", TOKEN_STATIC);
-      }
-    }
-    break;
-  case 't':
-    if (scanner.current - scanner.start > 1)
-    {
-      switch (scanner.start[1])
-      {
-      case 'h':
-        if (scanner.current - scanner.start > 2)
-        {
-          switch (scanner.start[2])
-          {
-          case 'i':
-            return check_keyword(3, 1, "s", TOKEN_THIS);
-          case 'r':
-            return check_keyword(3, 2, "ow", TOKEN_THROW);
-          }
-        }
-        break;
-      case 'r':
-        if (scanner.current - scanner.start > 2)
-        {
-          switch (scanner.start[2])
-          {
-          case 'u':
-            return check_keyword(3, 1, "e", TOKEN_TRUE);
-          case 'y':
-            return check_keyword(3, 0, "", TOKEN_TRY);
-          }
-        }
-        break;
-      }
-    }
-    break;
-  case 'l':
-    return check_keyword(1, 2, "et", TOKEN_LET);
-  case 'w':
-    return check_keyword(1, 4, "hile", TOKEN_WHILE);
-  }
-
-  return TOKEN_ID;
-}
+// The keyword trie (identifier_type) is generated from the keyword table in dev/keywords.ts, per dialect.
+#include "keywords.h"
 
-static Token identifier()
+static Token identifier(Scanner *scanner)
 {
-  while (is_alpha(peek()) || is_digit(peek()))
+  // Stays a byte loop. libc's strspn only has a vector routine for a few accepted characters, with the 63 of an
+  // identifier it builds a table on every call and is slower than this loop even for long names.
+  while (is_alpha(peek(scanner)) || is_digit(peek(scanner)))
   {
-    advance();
+    advance(scanner);
   }
 
-  return make_token(identifier_type());
+  return make_token(scanner, identifier_type(scanner));
 }
 
-static Token decimal()
+static Token decimal(Scanner *scanner)
 {
-  while (is_digit(peek()))
-  {
-    advance();
-  }
+  scanner->current = digits_end(scanner->current);
 
   // Look for a fractional part.
-  if (peek() == '.' && is_digit(peek_next()))
+  if (peek(scanner) == '.' && is_digit(peek_next(scanner)))
   {
-    advance(); // Consume the ".".
-
-    while (is_digit(peek()))
-    {
-      advance();
-    }
+    advance(scanner); // Consume the ".".
+    scanner->current = digits_end(scanner->current);
   }
 
 #ifdef DEBUG_PRINT_TOKENS
-  printf("NUMBER: %.*s\n", (int)(scanner.current - scanner.start), scanner.start);
+  printf("NUMBER: %.*s\n", (int)(scanner->current - scanner->start), scanner->start);
 #endif
 
-  return make_token(TOKEN_NUMBER);
+  return make_token(scanner, TOKEN_NUMBER);
 }
 
-static Token number(char chr)
+static Token number(Scanner *scanner, char chr)
 {
   if (chr != '0')
   {
-    return decimal();
+    return decimal(scanner);
   }
 
   Token number_token;
-  char kind = peek();
+  char kind = peek(scanner);
   switch (kind)
   {
   case 'x':
   case 'X':
   { // Hexadecimal
-    advance();
+    advance(scanner);
     int num_digits = 0;
-    while (is_digit(peek()) || (peek() >= 'a' && peek() <= 'f') || (peek() >= 'A' && peek() <= 'F'))
+    while (is_digit(peek(scanner)) || (peek(scanner) >= 'a' && peek(scanner) <= 'f') ||
+           (peek(scanner) >= 'A' && peek(scanner) <= 'F'))
     {
-      advance();
+      advance(scanner);
       num_digits++;
     }
     // Check literal length - this does not account for the actual value that results when parsing the literal
     if (num_digits <= 0 || num_digits > MAX_HEX_DIGITS)
     {
-      return error_token("Hexadecimal number literal must have at least one digit/letter and at most " STR(MAX_HEX_DIGITS) ".");
+      return error_token(scanner, SCAN_ERROR_HEX_LITERAL);
     }
-    number_token = make_token(TOKEN_NUMBER);
+    number_token = make_token(scanner, TOKEN_NUMBER);
     break;
   }
   case 'b': // Binary
   case 'B':
   {
-    advance();
+    advance(scanner);
     int num_digits = 0;
-    while (peek() == '0' || peek() == '1')
+    while (peek(scanner) == '0' || peek(scanner) == '1')
     {
-      advance();
+      advance(scanner);
       num_digits++;
     }
     // Check literal length - this does not account for the actual value that results when parsing the literal
     if (num_digits <= 0 || num_digits > MAX_BINARY_DIGITS)
     {
-      return error_token("Binary number literal must have at least one digit and at most " STR(MAX_BINARY_DIGITS) ".");
+      return error_token(scanner, SCAN_ERROR_BINARY_LITERAL);
     }
-    number_token = make_token(TOKEN_NUMBER);
+    number_token = make_token(scanner, TOKEN_NUMBER);
     break;
   }
   case 'o': // Octal
   case 'O':
   {
-    advance();
+    advance(scanner);
     int num_digits = 0;
-    while (peek() >= '0' && peek() <= '7')
+    while (peek(scanner) >= '0' && peek(scanner) <= '7')
     {
-      advance();
+      advance(scanner);
       num_digits++;
     }
     // Check literal length - this does not account for the actual value that results when parsing the literal
     if (num_digits <= 0 || num_digits > MAX_OCTAL_DIGITS)
     {
-      return error_token("Octal number literal must have at least one digit and at most " STR(MAX_OCTAL_DIGITS) ".");
+      return error_token(scanner, SCAN_ERROR_OCTAL_LITERAL);
     }
-    number_token = make_token(TOKEN_NUMBER);
+    number_token = make_token(scanner, TOKEN_NUMBER);
     break;
   }
 
   default:
-    return decimal(); // Otherwise, it's just a decimal
+    return decimal(scanner); // Otherwise, it's just a decimal
   }
 
 #ifdef DEBUG_PRINT_TOKENS
-  printf("NUMBER: %.*s\n", (int)(scanner.current - scanner.start), scanner.start);
+  printf("NUMBER: %.*s\n", (int)(scanner->current - scanner->start), scanner->start);
 #endif
 
   return number_token;
 }
 
-static Token string()
+static Token string(Scanner *scanner)
 {
-  while (peek() != '"' && !is_at_end())
+  for (;;)
   {
-    if (peek() == '\n')
+    scanner->current = string_special_char(scanner->current);
+    if (peek(scanner) == '"' || is_at_end(scanner))
+    {
+      break;
+    }
+
+    if (peek(scanner) == '\n')
     {
-      scanner.line++;
+      scanner->line++;
+      scanner->line_start = scanner->current + 1;
     }
     // Handle escape characters, accept any character after a backslash.
-    if (peek() == '\\')
+    if (peek(scanner) == '\\')
     {
-      advance();
+      advance(scanner);
+      if (is_at_end(scanner))
+      {
+        break;
+      }
+      if (peek(scanner) == '\n')
+      {
+        scanner->line++;
+        scanner->line_start = scanner->current + 1;
+      }
     }
 
-    advance();
+    advance(scanner);
   }
 
-  if (is_at_end())
+  // Only strings span lines, so if this one reaches the end of the chunk, the next chunk starts inside of it. That
+  // includes an unterminated string running up to a chunk_end that is the end of the source.
+  scanner->chunk_ends_in_string = scanner->chunk_end != NULL && scanner->current >= scanner->chunk_end;
+
+  if (is_at_end(scanner))
   {
-    return error_token("Unterminated string.");
+    return error_token(scanner, SCAN_ERROR_UNTERMINATED_STRING);
   }
 
-  advance(); // Consume the closing ".
+  advance(scanner); // Consume the closing ".
 
 #ifdef DEBUG_PRINT_TOKENS
-  printf("STRING: %.*s\n", (int)(scanner.current - scanner.start), scanner.start);
+  printf("STRING: %.*s\n", (int)(scanner->current - scanner->start), scanner->start);
 #endif
 
-  return make_token(TOKEN_STRING);
+  return make_token(scanner, TOKEN_STRING);
 }
 
-Token scanner_scan_token()
+Token scanner_scan_string_tail()
 {
-  scanner.is_first_on_line = false;
-
-  skip_whitespace();
-  scanner.start = scanner.current;
+  Scanner *scanner = &thread_scanner;
+  advance(scanner); // Consume the newline preceding the chunk.
+  scanner->line++;
+  scanner->line_start = scanner->current;
+  scanner->start = scanner->current;
+  return string(scanner);
+}
 
-  if (is_at_end())
+// Whether only whitespace precedes `position` on its line, i.e. a token there is the first on its line. A comment
+// counts as whitespace too, which only matters for the EOF token - nothing else can follow a comment on its line.
+static bool is_first_on_line(const Scanner *scanner, const char *position)
+{
+  const char *chr = scanner->line_start;
+  while (*chr == ' ' || *chr == '\t' || *chr == '\r')
   {
-    return make_token(TOKEN_EOF);
+    chr++;
   }
+  if (chr[0] == '/' && chr[1] == '/')
+  {
+    chr = comment_end(chr);
+  }
+  return chr == position;
+}
+
+static Token skip_block(Scanner *scanner)
+{
+  // Works on a local cursor and only looks at the characters that can affect brace balancing: braces themselves,
+  // strings and comments (which may contain braces) and newlines (to keep the line count right).
+  const char *current = scanner->current;
+  int depth = 1;
+
+  for (;;)
+  {
+    switch (*current)
+    {
+    case '\0':
+      scanner->current = current;
+      scanner->start = current;
+      scanner->is_first_on_line = is_first_on_line(scanner, current);
+      return make_token(scanner, TOKEN_EOF);
+    case '\n':
+      scanner->line++;
+      scanner->line_start = ++current;
+      break;
+    case '"':
+      current = string_special_char(current + 1);
+      while (*current != '"' && *current != '\0')
+      {
+        if (*current == '\\' && current[1] != '\0')
+        {
+          current++;
+        }
+        if (*current == '\n')
+        {
+          scanner->line++;
+          scanner->line_start = current + 1;
+        }
+        current = string_special_char(current + 1);
+      }
+      if (*current == '\0')
+      {
+        // Unterminated, so the string runs up to the end of the source - newlines in it don't make the EOF token
+        // the first on its line.
+        scanner->current = current;
+        scanner->start = current;
+        scanner->is_first_on_line = false;
+        return make_token(scanner, TOKEN_EOF);
+      }
+      current++;
+      break;
+    case '/':
+      if (current[1] == '/')
+      {
+        current = comment_end(current);
+      }
+      else
+      {
+        current++;
+      }
+      break;
+    case '{':
+      depth++;
+      current++;
+      break;
+    case '}':
+      current++;
+      if (--depth == 0)
+      {
+        scanner->start = current - 1;
+        scanner->current = current;
+        scanner->is_first_on_line = is_first_on_line(scanner, scanner->start);
+        return make_token(scanner, TOKEN_CBRACE);
+      }
+      break;
+    default:
+      current++;
+      break;
+    }
+  }
+}
+
+Token scanner_skip_block()
+{
+  return skip_block(&thread_scanner);
+}
+
+bool scanner_chunk_ends_in_string()
+{
+  return thread_scanner.chunk_ends_in_string;
+}
+
+ScanError scanner_get_last_error()
+{
+  return thread_scanner.last_error;
+}
+
+const char *scanner_get_error_message(ScanErrorCode code)
+{
+  return error_messages[code].message;
+}
+
+// Defined last, it's the scanner's main switch.
+static Token scan_token(Scanner *scanner);
+
+int scanner_lint(ScanError *errors, int capacity)
+{
+  Scanner *scanner = &thread_scanner;
+  int count = 0;
+  for (Token token = scan_token(scanner); token.type != TOKEN_EOF; token = scan_token(scanner))
+  {
+    if (token.type == TOKEN_ERROR)
+    {
+      if (count < capacity)
+      {
+        errors[count] = scanner->last_error;
+      }
+      count++;
+    }
+  }
+  return count;
+}
+
+// Names of the token kinds, e.g. for reports. Indexed by TokenKind.
+static const char *token_names[TOKEN_EOF + 1] = {
+    [TOKEN_OR] = "OR",
+    [TOKEN_AND] = "AND",
+    [TOKEN_EQ] = "EQ",
+    [TOKEN_NEQ] = "NEQ",
+    [TOKEN_GT] = "GT",
+    [TOKEN_LT] = "LT",
+    [TOKEN_GTEQ] = "GTEQ",
+    [TOKEN_LTEQ] = "LTEQ",
+    [TOKEN_PLUS] = "PLUS",
+    [TOKEN_MINUS] = "MINUS",
+    [TOKEN_MULT] = "MULT",
+    [TOKEN_DIV] = "DIV",
+    [TOKEN_MOD] = "MOD",
+    [TOKEN_NOT] = "NOT",
+    [TOKEN_TERNARY] = "TERNARY",
+    [TOKEN_PLUS_PLUS] = "PLUS_PLUS",
+    [TOKEN_MINUS_MINUS] = "MINUS_MINUS",
+    [TOKEN_DOT] = "DOT",
+    [TOKEN_DOTDOT] = "DOTDOT",
+    [TOKEN_DOTDOTDOT] = "DOTDOTDOT",
+    [TOKEN_COMMA] = "COMMA",
+    [TOKEN_COLON] = "COLON",
+    [TOKEN_SCOLON] = "SCOLON",
+    [TOKEN_ASSIGN] = "ASSIGN",
+    [TOKEN_OPAR] = "OPAR",
+    [TOKEN_CPAR] = "CPAR",
+    [TOKEN_OBRACE] = "OBRACE",
+    [TOKEN_CBRACE] = "CBRACE",
+    [TOKEN_OBRACK] = "OBRACK",
+    [TOKEN_CBRACK] = "CBRACK",
+    [TOKEN_PLUS_ASSIGN] = "PLUS_ASSIGN",
+    [TOKEN_MINUS_ASSIGN] = "MINUS_ASSIGN",
+    [TOKEN_MULT_ASSIGN] = "MULT_ASSIGN",
+    [TOKEN_DIV_ASSIGN] = "DIV_ASSIGN",
+    [TOKEN_MOD_ASSIGN] = "MOD_ASSIGN",
+    [TOKEN_LAMBDA] = "LAMBDA",
+    [TOKEN_TRUE] = "TRUE",
+    [TOKEN_FALSE] = "FALSE",
+    [TOKEN_NIL] = "NIL",
+    [TOKEN_IF] = "IF",
+    [TOKEN_IMPORT] = "IMPORT",
+    [TOKEN_FROM] = "FROM",
+    [TOKEN_ELSE] = "ELSE",
+    [TOKEN_WHILE] = "WHILE",
+    [TOKEN_FOR] = "FOR",
+    [TOKEN_BREAK] = "BREAK",
+    [TOKEN_SKIP] = "SKIP",
+    [TOKEN_CLASS] = "CLASS",
+    [TOKEN_STATIC] = "STATIC",
+    [TOKEN_THIS] = "THIS",
+    [TOKEN_PRINT] = "PRINT",
+    [TOKEN_FN] = "FN",
+    [TOKEN_RETURN] = "RETURN",
+    [TOKEN_LET] = "LET",
+    [TOKEN_CONST] = "CONST",
+    [TOKEN_CTOR] = "CTOR",
+    [TOKEN_BASE] = "BASE",
+    [TOKEN_TRY] = "TRY",
+    [TOKEN_THROW] = "THROW",
+    [TOKEN_CATCH] = "CATCH",
+    [TOKEN_IS] = "IS",
+    [TOKEN_IN] = "IN",
+    [TOKEN_ID] = "ID",
+    [TOKEN_NUMBER] = "NUMBER",
+    [TOKEN_STRING] = "STRING",
+    [TOKEN_OTHER] = "OTHER",
+    [TOKEN_COMMENT] = "COMMENT",
+    [TOKEN_ERROR] = "ERROR",
+    [TOKEN_EOF] = "EOF",
+};
+
+void scanner_scan_metrics(SourceMetrics *metrics)
+{
+  Scanner *scanner = &thread_scanner;
+  memset(metrics, 0, sizeof(*metrics));
+  scanner->keep_comments = true; // To tell comment lines from blank ones.
+
+  int last_code_line = 0;
+  int last_comment_line = 0;
+  Token token;
+  for (;;)
+  {
+    token = scan_token(scanner);
+    metrics->tokens[token.type]++;
+    if (token.type == TOKEN_EOF)
+    {
+      break;
+    }
+
+    if (token.type == TOKEN_COMMENT)
+    {
+      // A comment runs to the end of the line, so if there was no code before it, the line is comment-only.
+      if (token.line != last_code_line && token.line != last_comment_line)
+      {
+        metrics->comment_lines++;
+        last_comment_line = token.line;
+      }
+      continue;
+    }
+
+    // Strings (and unterminated ones) span lines, every one of which counts as a code line. The token's line is the
+    // one it ends on.
+    const char *start = token.type == TOKEN_ERROR ? scanner->last_error.start : token.start;
+    int length = token.type == TOKEN_ERROR ? scanner->last_error.length : token.length;
+    int first_line = token.line;
+    for (const char *chr = start; (chr = memchr(chr, '\n', start + length - chr)) != NULL; chr++)
+    {
+      first_line--;
+    }
+
+    metrics->code_lines += token.line - (first_line > last_code_line ? first_line : last_code_line + 1) + 1;
+    last_code_line = token.line;
+
+    if (token.type == TOKEN_STRING)
+    {
+      metrics->string_bytes += token.length;
+    }
+    else if (token.type == TOKEN_NUMBER)
+    {
+      metrics->number_bytes += token.length;
+    }
+  }
+
+  // A trailing newline ends the last line, it doesn't start a new one.
+  bool ends_with_newline = token.start == scanner->source || token.start[-1] == '\n';
+  metrics->lines = token.line - (ends_with_newline ? 1 : 0);
+  metrics->blank_lines = metrics->lines - metrics->code_lines - metrics->comment_lines;
+}
+
+void metrics_add(SourceMetrics *total, const SourceMetrics *metrics)
+{
+  total->lines += metrics->lines;
+  total->code_lines += metrics->code_lines;
+  total->comment_lines += metrics->comment_lines;
+  total->blank_lines += metrics->blank_lines;
+  total->string_bytes += metrics->string_bytes;
+  total->number_bytes += metrics->number_bytes;
+  for (int i = 0; i <= TOKEN_EOF; i++)
+  {
+    total->tokens[i] += metrics->tokens[i];
+  }
+}
+
+void metrics_write_json(FILE *file, const char *path, const SourceMetrics *metrics)
+{
+  fprintf(file, "{\"path\":\"");
+  for (const char *chr = path; *chr != '\0'; chr++)
+  {
+    if (*chr == '"' || *chr == '\\')
+    {
+      fputc('\\', file);
+      fputc(*chr, file);
+    }
+    else if ((uint8_t)*chr < 0x20)
+    {
+      fprintf(file, "\\u%04x", *chr); // Control characters, e.g. a newline in a file name, must be escaped in JSON.
+    }
+    else
+    {
+      fputc(*chr, file);
+    }
+  }
+  fprintf(file, "\",\"lines\":%ld,\"code\":%ld,\"comment\":%ld,\"blank\":%ld,\"stringBytes\":%ld,\"numberBytes\":%ld,",
+          metrics->lines, metrics->code_lines, metrics->comment_lines, metrics->blank_lines, metrics->string_bytes,
+          metrics->number_bytes);
+
+  fprintf(file, "\"tokens\":{");
+  bool first = true;
+  for (int i = 0; i < TOKEN_EOF; i++)
+  {
+    if (metrics->tokens[i] > 0)
+    {
+      fprintf(file, "%s\"%s\":%ld", first ? "" : ",", token_names[i], metrics->tokens[i]);
+      first = false;
+    }
+  }
+  fprintf(file, "}}\n");
+}
+
+int scanner_scan_batch(Token *tokens, int capacity)
+{
+  Scanner *scanner = &thread_scanner;
+  int count = 0;
+  while (count < capacity)
+  {
+    Token token = scan_token(scanner);
+    tokens[count++] = token;
+    if (token.type == TOKEN_EOF)
+    {
+      break;
+    }
+  }
+  return count;
+}
+
+void token_queue_init(TokenQueue *queue)
+{
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+}
+
+TokenBatch *token_queue_reserve(TokenQueue *queue)
+{
+  // Only the producer writes the tail, so a relaxed load is enough. Acquire on the head, so we don't overwrite a batch
+  // the consumer is still reading.
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  if (tail - head == TOKEN_QUEUE_BATCHES)
+  {
+    return NULL;
+  }
+  return &queue->batches[tail % TOKEN_QUEUE_BATCHES];
+}
+
+void token_queue_publish(TokenQueue *queue)
+{
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+TokenBatch *token_queue_peek(TokenQueue *queue)
+{
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  if (head == tail)
+  {
+    return NULL;
+  }
+  return &queue->batches[head % TOKEN_QUEUE_BATCHES];
+}
+
+void token_queue_release(TokenQueue *queue)
+{
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
+
+// Wait a little before polling the other side of a queue again. The first polls only pause the core, which is cheap
+// and keeps the latency low when the other side is about to catch up. After that, give the core away, so a waiting
+// thread doesn't starve the one it's waiting on when there are fewer cores than threads.
+static void queue_back_off(int *polls)
+{
+  if (++*polls < 64)
+  {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#elif defined(__GNUC__) && defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+  }
+  else
+  {
+#if defined(__unix__) || defined(__APPLE__)
+    sched_yield();
+#endif
+  }
+}
+
+TokenBatch *token_queue_wait(TokenQueue *queue)
+{
+  int polls = 0;
+  TokenBatch *batch;
+  while ((batch = token_queue_peek(queue)) == NULL)
+  {
+    queue_back_off(&polls); // The scanner is still scanning the next batch.
+  }
+  return batch;
+}
+
+void scanner_fill_queue(TokenQueue *queue)
+{
+  queue->source = thread_scanner.source;
+  for (;;)
+  {
+    int polls = 0;
+    TokenBatch *batch;
+    while ((batch = token_queue_reserve(queue)) == NULL)
+    {
+      queue_back_off(&polls); // The consumer is busy compiling the batches before this one.
+    }
+
+    batch->count = scanner_scan_batch(batch->tokens, TOKEN_BATCH_SIZE);
+    bool done = batch->tokens[batch->count - 1].type == TOKEN_EOF;
+    token_queue_publish(queue);
+
+    if (done)
+    {
+      return;
+    }
+  }
+}
+
+// FNV-1a, cheap and good enough to tell whether a declaration changed.
+static uint32_t hash_bytes(uint32_t hash, const char *bytes, int length)
+{
+  for (int i = 0; i < length; i++)
+  {
+    hash ^= (uint8_t)bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// A declaration being hashed. A class stays open while one of its methods is hashed.
+typedef struct
+{
+  DeclarationHash *hash;
+  int index;   // Index among the declarations found, which the class's methods refer to.
+  int depth;   // Brace depth of the declaration itself, its body is one deeper.
+  bool braced; // Whether the brace opening its body was seen.
+  bool arrow;  // Whether it has an `->` body, which ends with its line.
+  bool is_class;
+  int header_tokens; // Tokens after a class's name so far - `: Base {` at most, before its body.
+} OpenDeclaration;
+
+// Whether `token` continues the header of an unbraced class, i.e. is its `: Base` or the brace opening its body.
+static bool continues_class_header(const OpenDeclaration *declaration, Token token)
+{
+  switch (declaration->header_tokens)
+  {
+  case 0:
+    return token.type == TOKEN_COLON || token.type == TOKEN_OBRACE;
+  case 1:
+    return token.type == TOKEN_ID;
+  case 2:
+    return token.type == TOKEN_OBRACE;
+  default:
+    return false;
+  }
+}
+
+int scanner_hash_declarations(DeclarationHash *hashes, int capacity)
+{
+  Scanner *scanner = &thread_scanner;
+  int count = 0;
+  int depth = 0;              // Brace depth.
+  int nesting = 0;            // Paren and bracket depth, an `->` body continues on lines inside of them.
+  OpenDeclaration open[2];    // A class and one of its methods, at most.
+  int open_count = 0;
+  DeclarationHash ignored[2]; // Sinks for declarations beyond capacity.
+  Token previous = {.type = TOKEN_EOF};
+
+  for (Token token; (token = scan_token(scanner)).type != TOKEN_EOF; previous = token)
+  {
+    // Declarations without a braced body end early. A bodiless class ends with its header. Functions end where the
+    // next declaration next to them starts, where the enclosing class body closes or, for `->` bodies, on the next
+    // line.
+    while (open_count > 0 && !open[open_count - 1].braced && depth == open[open_count - 1].depth)
+    {
+      OpenDeclaration *declaration = &open[open_count - 1];
+      bool ends_line = declaration->arrow && nesting == 0 && token.is_first_on_line && previous.type != TOKEN_LAMBDA;
+      bool ends_function = token.type == TOKEN_FN || token.type == TOKEN_CLASS || token.type == TOKEN_CTOR ||
+                           token.type == TOKEN_STATIC || token.type == TOKEN_CBRACE || ends_line;
+      if (declaration->is_class ? continues_class_header(declaration, token) : !ends_function)
+      {
+        break;
+      }
+      open_count--;
+    }
+
+    bool in_class_body = open_count == 1 && open[0].is_class && open[0].braced && depth == open[0].depth + 1;
+    bool is_named = token.type == TOKEN_ID && (previous.type == TOKEN_FN || previous.type == TOKEN_CLASS);
+    if ((is_named && open_count == 0 && depth == 0) || (is_named && in_class_body && previous.type == TOKEN_FN) ||
+        (token.type == TOKEN_CTOR && in_class_body))
+    {
+      OpenDeclaration *declaration = &open[open_count];
+      TokenKind kind = token.type == TOKEN_CTOR ? TOKEN_CTOR : previous.type;
+      declaration->hash = count < capacity ? &hashes[count] : &ignored[open_count];
+      declaration->hash->name = token;
+      declaration->hash->parent = open_count > 0 ? open[0].index : -1;
+      declaration->hash->hash = hash_bytes(2166136261u, (const char *)&kind, sizeof(kind));
+      declaration->index = count++;
+      declaration->depth = depth;
+      declaration->braced = false;
+      declaration->arrow = false;
+      declaration->is_class = kind == TOKEN_CLASS;
+      declaration->header_tokens = -1; // The name is counted below, like every token of the declaration.
+      open_count++;
+    }
+
+    if (open_count > 0)
+    {
+      // Only kinds and lexemes go into the hash. Whitespace and comments never make it into a token, and positions
+      // are left out on purpose, so that edits elsewhere in the file don't mark this declaration as changed. Tokens
+      // only go into the innermost declaration, so a class's hash doesn't change with the bodies of its methods.
+      OpenDeclaration *declaration = &open[open_count - 1];
+      if (!declaration->braced && depth == declaration->depth && nesting == 0)
+      {
+        declaration->braced = token.type == TOKEN_OBRACE && !declaration->arrow;
+        declaration->arrow = declaration->arrow || token.type == TOKEN_LAMBDA;
+        declaration->header_tokens++;
+      }
+      declaration->hash->hash = hash_bytes(declaration->hash->hash, (const char *)&token.type, sizeof(token.type));
+      declaration->hash->hash = hash_bytes(declaration->hash->hash, token.start, token.length);
+    }
+
+    switch (token.type)
+    {
+    case TOKEN_OBRACE:
+      depth++;
+      break;
+    case TOKEN_CBRACE:
+      depth -= depth > 0 ? 1 : 0;
+      if (open_count > 0 && open[open_count - 1].braced && depth == open[open_count - 1].depth)
+      {
+        open_count--;
+      }
+      break;
+    case TOKEN_OPAR:
+    case TOKEN_OBRACK:
+      nesting++;
+      break;
+    case TOKEN_CPAR:
+    case TOKEN_CBRACK:
+      nesting -= nesting > 0 ? 1 : 0;
+      break;
+    default:
+      break;
+    }
+  }
+
+  return count;
+}
+
+static void add_outline_symbol(OutlineSymbol *symbols, int capacity, int *count, OutlineKind kind, Token name)
+{
+  if (*count < capacity)
+  {
+    symbols[*count].kind = kind;
+    symbols[*count].name = name;
+  }
+  (*count)++;
+}
+
+int scanner_scan_outline(OutlineSymbol *symbols, int capacity)
+{
+  Scanner *scanner = &thread_scanner;
+  int count = 0;
+  bool in_class = false;      // Inside a class body, where members are declared.
+  bool class_is_next = false; // Saw a class header, so a brace right after it opens its body.
+  Token previous = {.type = TOKEN_EOF};
+  Token before_previous = {.type = TOKEN_EOF};
+
+  for (Token token; (token = scan_token(scanner)).type != TOKEN_EOF; before_previous = previous, previous = token)
+  {
+    // The body has to follow the class name or its `: Base` directly. Anything else means the class has no body, and
+    // the brace of the next function or block must not be taken for it.
+    if (class_is_next && !(token.type == TOKEN_COLON && before_previous.type == TOKEN_CLASS) &&
+        !(token.type == TOKEN_ID && previous.type == TOKEN_COLON) &&
+        !(token.type == TOKEN_OBRACE && previous.type == TOKEN_ID))
+    {
+      class_is_next = false;
+    }
+
+    switch (token.type)
+    {
+    case TOKEN_ID:
+      switch (previous.type)
+      {
+      case TOKEN_CLASS:
+        add_outline_symbol(symbols, capacity, &count, OUTLINE_CLASS, token);
+        class_is_next = true;
+        break;
+      case TOKEN_FN:
+        add_outline_symbol(symbols, capacity, &count,
+                           !in_class                              ? OUTLINE_FN
+                           : before_previous.type == TOKEN_STATIC ? OUTLINE_STATIC_METHOD
+                                                                  : OUTLINE_METHOD,
+                           token);
+        break;
+      case TOKEN_LET:
+      case TOKEN_CONST:
+        // Skip loop variables, e.g. `for let i = 0; ...`.
+        if (!in_class && before_previous.type != TOKEN_FOR && before_previous.type != TOKEN_OPAR)
+        {
+          add_outline_symbol(symbols, capacity, &count, previous.type == TOKEN_LET ? OUTLINE_LET : OUTLINE_CONST,
+                             token);
+        }
+        break;
+      case TOKEN_IMPORT:
+        add_outline_symbol(symbols, capacity, &count, OUTLINE_IMPORT, token);
+        break;
+      default:
+        break;
+      }
+      break;
+    case TOKEN_CTOR:
+      if (in_class)
+      {
+        add_outline_symbol(symbols, capacity, &count, OUTLINE_CTOR, token);
+      }
+      break;
+    case TOKEN_OBRACE:
+      if (class_is_next)
+      {
+        in_class = true;
+        class_is_next = false;
+      }
+      else
+      {
+        // Function bodies and top-level blocks don't declare anything that belongs in the outline.
+        token = skip_block(scanner);
+      }
+      break;
+    case TOKEN_CBRACE:
+      in_class = false;
+      break;
+    default:
+      break;
+    }
+  }
+
+  return count;
+}
+
+// Final mix of a k-gram hash. The rolling hash of small token kinds is badly distributed, and winnowing picks minima -
+// without mixing, the same few k-grams would always win.
+static uint32_t mix_hash(uint32_t hash)
+{
+  hash ^= hash >> 16;
+  hash *= 0x45d9f3bu;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+int scanner_winnow(const Token *tokens, int count, int k, int w, Fingerprint *fingerprints, int capacity)
+{
+  uint32_t hashes[WINNOW_MAX_WINDOW];  // Ring of the last w k-gram hashes.
+  int positions[WINNOW_MAX_WINDOW];    // Ring of the token indices they start at.
+  int starts[WINNOW_MAX_K];            // Ring of the token indices of the current k-gram.
+  uint32_t base_to_k = 1;              // 31^k, to roll the oldest token out of the hash.
+  uint32_t hash = 0;
+  int symbols = 0; // Tokens hashed so far.
+  int grams = 0;   // K-grams hashed so far.
+  int min = -1;    // K-gram number of the current window's minimum.
+  int last = -1;   // K-gram number of the last recorded fingerprint.
+  int fingerprint_count = 0;
+
+  if (k < 1 || k > WINNOW_MAX_K || w < 1 || w > WINNOW_MAX_WINDOW)
+  {
+    return 0;
+  }
+  for (int i = 0; i < k; i++)
+  {
+    base_to_k *= 31u;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    // Normalize: only the kind counts. All identifiers look the same, and literals are bucketed by their kind.
+    TokenKind type = tokens[i].type;
+    if (type == TOKEN_EOF || type == TOKEN_COMMENT)
+    {
+      continue;
+    }
+
+    hash = hash * 31u + (uint32_t)type + 1;
+    if (symbols >= k)
+    {
+      hash -= base_to_k * ((uint32_t)tokens[starts[symbols % k]].type + 1);
+    }
+    starts[symbols % k] = i;
+    symbols++;
+    if (symbols < k)
+    {
+      continue;
+    }
+
+    int gram = grams++;
+    hashes[gram % w] = mix_hash(hash);
+    positions[gram % w] = starts[symbols % k]; // The oldest token of the k-gram, i.e. where it starts.
+    if (gram < w - 1)
+    {
+      continue;
+    }
+
+    // Keep the rightmost minimum of the window. Only rescan the window once the minimum slides out of it.
+    if (min <= gram - w)
+    {
+      min = gram - w + 1;
+      for (int j = gram - w + 2; j <= gram; j++)
+      {
+        if (hashes[j % w] <= hashes[min % w])
+        {
+          min = j;
+        }
+      }
+    }
+    else if (hashes[gram % w] <= hashes[min % w])
+    {
+      min = gram;
+    }
+
+    if (min != last)
+    {
+      if (fingerprint_count < capacity)
+      {
+        fingerprints[fingerprint_count].hash = hashes[min % w];
+        fingerprints[fingerprint_count].token = positions[min % w];
+      }
+      fingerprint_count++;
+      last = min;
+    }
+  }
+
+  return fingerprint_count;
+}
+
+static TokenKind closing_bracket(TokenKind type)
+{
+  switch (type)
+  {
+  case TOKEN_OPAR:
+    return TOKEN_CPAR;
+  case TOKEN_OBRACE:
+    return TOKEN_CBRACE;
+  case TOKEN_OBRACK:
+    return TOKEN_CBRACK;
+  default:
+    return TOKEN_EOF;
+  }
+}
+
+static void add_mismatch(BracketMismatch *mismatches, int capacity, int *count, int open, int close)
+{
+  if (*count < capacity)
+  {
+    mismatches[*count].open = open;
+    mismatches[*count].close = close;
+  }
+  (*count)++;
+}
+
+int scanner_pair_brackets(const Token *tokens, int count, int *partners, BracketMismatch *mismatches, int capacity)
+{
+  int mismatch_count = 0;
+  int top = -1; // Index of the innermost open bracket.
+
+  for (int i = 0; i < count; i++)
+  {
+    partners[i] = -1;
+    switch (tokens[i].type)
+    {
+    case TOKEN_OPAR:
+    case TOKEN_OBRACE:
+    case TOKEN_OBRACK:
+      // While a bracket is open, its slot links to the next outer open bracket. So the stack lives in `partners`.
+      partners[i] = top;
+      top = i;
+      break;
+    case TOKEN_CPAR:
+    case TOKEN_CBRACE:
+    case TOKEN_CBRACK:
+    {
+      if (top == -1)
+      {
+        add_mismatch(mismatches, capacity, &mismatch_count, -1, i);
+        break;
+      }
+
+      int open = top;
+      top = partners[open];
+      if (closing_bracket(tokens[open].type) == tokens[i].type)
+      {
+        partners[open] = i;
+        partners[i] = open;
+      }
+      else
+      {
+        partners[open] = -1;
+        add_mismatch(mismatches, capacity, &mismatch_count, open, i);
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  // Whatever is left on the stack is never closed.
+  while (top != -1)
+  {
+    int open = top;
+    top = partners[open];
+    partners[open] = -1;
+    add_mismatch(mismatches, capacity, &mismatch_count, open, -1);
+  }
+
+  return mismatch_count;
+}
+
+// Magic bytes at the start of an encoded token module. Can't be the start of valid source, since it starts with NUL.
+static const uint8_t token_module_magic[] = {'\0', 'S', 'L', 'T', 'K', 1};
+
+// Set on a token's kind byte if it follows the previous token after exactly one space, on the same line - the common
+// case, which then needs no position data.
+#define TOKEN_MODULE_COMPACT 0x80
+
+typedef struct
+{
+  uint8_t *bytes;
+  size_t count;
+  size_t capacity;
+} ByteBuffer;
+
+static void buffer_write(ByteBuffer *buffer, const void *bytes, size_t count)
+{
+  if (buffer->count + count > buffer->capacity)
+  {
+    while (buffer->count + count > buffer->capacity)
+    {
+      buffer->capacity = buffer->capacity < 256 ? 256 : buffer->capacity * 2;
+    }
+    buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+    if (buffer->bytes == NULL)
+    {
+      exit(1);
+    }
+  }
+  memcpy(buffer->bytes + buffer->count, bytes, count);
+  buffer->count += count;
+}
+
+static void buffer_write_varint(ByteBuffer *buffer, uint32_t value)
+{
+  uint8_t bytes[5];
+  size_t count = 0;
+  do
+  {
+    bytes[count] = (uint8_t)(value & 0x7F);
+    value >>= 7;
+    if (value != 0)
+    {
+      bytes[count] |= 0x80;
+    }
+    count++;
+  } while (value != 0);
+  buffer_write(buffer, bytes, count);
+}
+
+static bool read_varint(const uint8_t **current, const uint8_t *end, uint32_t *value)
+{
+  *value = 0;
+  for (int shift = 0; shift < 35; shift += 7)
+  {
+    if (*current == end)
+    {
+      return false;
+    }
+    uint8_t byte = *(*current)++;
+    *value |= (uint32_t)(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Lexeme dictionary of the encoder. Entries point into the source, an open-addressing table deduplicates them.
+typedef struct
+{
+  const char **starts;
+  int *lengths;
+  int count;
+  int *slots; // Entry index + 1, 0 if empty. Capacity is a power of two.
+  int slot_capacity;
+} Dictionary;
+
+static int dictionary_add(Dictionary *dictionary, const char *start, int length)
+{
+  if ((dictionary->count + 1) * 2 > dictionary->slot_capacity)
+  {
+    // Grow and rehash.
+    int capacity = dictionary->slot_capacity < 256 ? 256 : dictionary->slot_capacity * 2;
+    int *slots = calloc(capacity, sizeof(int));
+    dictionary->starts = realloc(dictionary->starts, sizeof(const char *) * capacity / 2);
+    dictionary->lengths = realloc(dictionary->lengths, sizeof(int) * capacity / 2);
+    if (slots == NULL || dictionary->starts == NULL || dictionary->lengths == NULL)
+    {
+      exit(1);
+    }
+    for (int i = 0; i < dictionary->count; i++)
+    {
+      uint32_t slot = hash_bytes(2166136261u, dictionary->starts[i], dictionary->lengths[i]) & (capacity - 1);
+      while (slots[slot] != 0)
+      {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      slots[slot] = i + 1;
+    }
+    free(dictionary->slots);
+    dictionary->slots = slots;
+    dictionary->slot_capacity = capacity;
+  }
+
+  uint32_t slot = hash_bytes(2166136261u, start, length) & (dictionary->slot_capacity - 1);
+  while (dictionary->slots[slot] != 0)
+  {
+    int index = dictionary->slots[slot] - 1;
+    if (dictionary->lengths[index] == length && memcmp(dictionary->starts[index], start, length) == 0)
+    {
+      return index;
+    }
+    slot = (slot + 1) & (dictionary->slot_capacity - 1);
+  }
+
+  int index = dictionary->count++;
+  dictionary->starts[index] = start;
+  dictionary->lengths[index] = length;
+  dictionary->slots[slot] = index + 1;
+  return index;
+}
+
+// Whether the lexeme of a kind varies, so every token of it needs its dictionary index.
+static bool has_own_lexeme(TokenKind type)
+{
+  return type == TOKEN_ID || type == TOKEN_NUMBER || type == TOKEN_STRING;
+}
+
+uint8_t *token_module_encode(const char *source, size_t *size)
+{
+  Dictionary dictionary = {0};
+  ByteBuffer tokens = {0};
+  bool kind_seen[TOKEN_EOF + 1] = {false};
+  const char *previous_end = source;
+  uint32_t token_count = 0;
+  bool failed = false;
+
+  Scanner *scanner = &thread_scanner;
+  scanner_init(source);
+  for (;;)
+  {
+    Token token = scan_token(scanner);
+    if (token.type == TOKEN_ERROR)
+    {
+      failed = true;
+      break;
+    }
+
+    uint32_t gap = (uint32_t)(token.start - previous_end);
+    uint32_t newlines = 0;
+    for (const char *chr = previous_end; (chr = memchr(chr, '\n', token.start - chr)) != NULL; chr++)
+    {
+      newlines++;
+    }
+
+    uint8_t kind = (uint8_t)token.type;
+    if (gap == 1 && newlines == 0)
+    {
+      kind |= TOKEN_MODULE_COMPACT;
+    }
+    buffer_write(&tokens, &kind, 1);
+    if ((kind & TOKEN_MODULE_COMPACT) == 0)
+    {
+      buffer_write_varint(&tokens, gap);
+      buffer_write_varint(&tokens, newlines);
+      if (newlines > 0)
+      {
+        buffer_write_varint(&tokens, (uint32_t)(token.start - scanner_get_line_start(token)));
+      }
+    }
+
+    if (has_own_lexeme(token.type) || !kind_seen[token.type])
+    {
+      buffer_write_varint(&tokens, (uint32_t)dictionary_add(&dictionary, token.start, token.length));
+      kind_seen[token.type] = true;
+    }
+
+    token_count++;
+    previous_end = token.start + token.length;
+    if (token.type == TOKEN_EOF)
+    {
+      break;
+    }
+  }
+
+  ByteBuffer module = {0};
+  if (!failed)
+  {
+    buffer_write(&module, token_module_magic, sizeof(token_module_magic));
+    buffer_write_varint(&module, (uint32_t)dictionary.count);
+    for (int i = 0; i < dictionary.count; i++)
+    {
+      buffer_write_varint(&module, (uint32_t)dictionary.lengths[i]);
+      buffer_write(&module, dictionary.starts[i], dictionary.lengths[i]);
+    }
+    buffer_write_varint(&module, token_count);
+    buffer_write(&module, tokens.bytes, tokens.count);
+  }
+
+  free(dictionary.starts);
+  free(dictionary.lengths);
+  free(dictionary.slots);
+  free(tokens.bytes);
+
+  *size = module.count;
+  return module.bytes;
+}
+
+bool token_module_is_encoded(const uint8_t *data, size_t size)
+{
+  return size >= sizeof(token_module_magic) && memcmp(data, token_module_magic, sizeof(token_module_magic)) == 0;
+}
+
+int token_module_count_tokens(const uint8_t *data, size_t size)
+{
+  if (!token_module_is_encoded(data, size))
+  {
+    return -1;
+  }
+
+  const uint8_t *current = data + sizeof(token_module_magic);
+  const uint8_t *end = data + size;
+  uint32_t entry_count;
+  if (!read_varint(&current, end, &entry_count))
+  {
+    return -1;
+  }
+  for (uint32_t i = 0; i < entry_count; i++)
+  {
+    uint32_t length;
+    if (!read_varint(&current, end, &length) || length > (size_t)(end - current))
+    {
+      return -1;
+    }
+    current += length;
+  }
+
+  uint32_t token_count;
+  if (!read_varint(&current, end, &token_count))
+  {
+    return -1;
+  }
+  return (int)token_count;
+}
+
+int token_module_decode(const uint8_t *data, size_t size, Token *tokens, TokenPosition *positions, int capacity)
+{
+  int token_count = token_module_count_tokens(data, size);
+  if (token_count < 0 || token_count > capacity)
+  {
+    return -1;
+  }
+
+  const uint8_t *current = data + sizeof(token_module_magic);
+  const uint8_t *end = data + size;
+  uint32_t entry_count;
+  read_varint(&current, end, &entry_count);
+
+  // Lexemes stay in the module, tokens point right into it.
+  const char **entries = malloc(sizeof(const char *) * (entry_count + 1));
+  int *lengths = malloc(sizeof(int) * (entry_count + 1));
+  if (entries == NULL || lengths == NULL)
+  {
+    exit(1);
+  }
+  for (uint32_t i = 0; i < entry_count; i++)
+  {
+    uint32_t length;
+    read_varint(&current, end, &length);
+    entries[i] = (const char *)current;
+    lengths[i] = (int)length;
+    current += length;
+  }
+  uint32_t ignored;
+  read_varint(&current, end, &ignored); // Token count, already known.
+
+  int kind_entries[TOKEN_EOF + 1];
+  for (int i = 0; i <= TOKEN_EOF; i++)
+  {
+    kind_entries[i] = -1;
+  }
+
+  // Wider than the positions they end up in, so gaps and newlines from a malformed module can't overflow them.
+  int64_t offset = 0;     // Source offset right after the previous token.
+  int64_t line_start = 0; // Source offset of the start of the current line.
+  int64_t line = 1;
+  int count = 0;
+  bool malformed = false;
+  while (count < token_count)
+  {
+    if (current == end || (*current & ~TOKEN_MODULE_COMPACT) > TOKEN_EOF)
+    {
+      malformed = true;
+      break;
+    }
+    uint8_t kind = *current++;
+    TokenKind type = (TokenKind)(kind & ~TOKEN_MODULE_COMPACT);
+
+    uint32_t gap = 1;
+    uint32_t newlines = 0;
+    uint32_t column = 0;
+    if ((kind & TOKEN_MODULE_COMPACT) == 0)
+    {
+      malformed = !read_varint(&current, end, &gap) || !read_varint(&current, end, &newlines) ||
+                  (newlines > 0 && !read_varint(&current, end, &column));
+    }
+
+    uint32_t entry = (uint32_t)kind_entries[type];
+    if (has_own_lexeme(type) || kind_entries[type] == -1)
+    {
+      malformed = malformed || !read_varint(&current, end, &entry);
+      kind_entries[type] = (int)entry;
+    }
+    if (malformed || entry >= entry_count)
+    {
+      malformed = true;
+      break;
+    }
+
+    offset += gap;
+    line += newlines;
+    if (offset > INT_MAX || column > offset)
+    {
+      malformed = true;
+      break;
+    }
+    if (newlines > 0)
+    {
+      line_start = offset - column;
+    }
+
+    Token *token = &tokens[count];
+    token->type = type;
+    token->start = entries[entry];
+    token->length = lengths[entry];
+    token->is_first_on_line = newlines > 0;
+    positions[count].offset = (int)offset;
+    positions[count].column = (int)(offset - line_start);
+
+    // Newlines within the token (multi-line strings) move on the line, the token's line is the one it ends on.
+    for (int i = 0; i < token->length; i++)
+    {
+      if (token->start[i] == '\n')
+      {
+        line++;
+        line_start = offset + i + 1;
+      }
+    }
+    if (line > INT_MAX)
+    {
+      malformed = true;
+      break;
+    }
+    token->line = (int)line;
+
+    offset += token->length;
+    count++;
+  }
+
+  free(entries);
+  free(lengths);
+  return malformed ? -1 : count;
+}
+
+void line_table_init(LineTable *table)
+{
+  table->count = 0;
+  table->capacity = 0;
+  table->offsets = NULL;
+  table->lines = NULL;
+}
+
+void line_table_free(LineTable *table)
+{
+  free(table->offsets);
+  free(table->lines);
+  line_table_init(table);
+}
+
+void line_table_add(LineTable *table, int offset, int line)
+{
+  // Most consecutive bytes share a line, those just extend the current run.
+  if (table->count > 0 && table->lines[table->count - 1] == line)
+  {
+    return;
+  }
+
+  if (table->count == table->capacity)
+  {
+    table->capacity = table->capacity < 8 ? 8 : table->capacity * 2;
+    table->offsets = realloc(table->offsets, sizeof(int) * table->capacity);
+    table->lines = realloc(table->lines, sizeof(int) * table->capacity);
+    if (table->offsets == NULL || table->lines == NULL)
+    {
+      exit(1);
+    }
+  }
+
+  table->offsets[table->count] = offset;
+  table->lines[table->count] = line;
+  table->count++;
+}
+
+int line_table_get(const LineTable *table, int offset)
+{
+  // Find the last run starting at or before the offset.
+  int low = 0;
+  int high = table->count - 1;
+  while (low < high)
+  {
+    int mid = low + (high - low + 1) / 2;
+    if (table->offsets[mid] <= offset)
+    {
+      low = mid;
+    }
+    else
+    {
+      high = mid - 1;
+    }
+  }
+
+  return table->count > 0 ? table->lines[low] : -1;
+}
+
+void repl_input_init(ReplInput *input)
+{
+  input->depth = 0;
+  input->in_string = false;
+  input->in_comment = false;
+  input->escaped = false;
+  input->slash = false;
+}
+
+void repl_input_append(ReplInput *input, const char *text)
+{
+  // Only strings, comments and brackets decide whether the input is complete, so this skips everything else instead
+  // of building tokens. All state that can straddle two appends (escapes, a comment's first slash) lives in `input`.
+  const char *current = text;
+  while (*current != '\0')
+  {
+    if (input->in_comment)
+    {
+      current = comment_end(current);
+      if (*current == '\n')
+      {
+        input->in_comment = false;
+        current++;
+      }
+      continue;
+    }
 
-  char chr = advance();
+    if (input->in_string)
+    {
+      if (input->escaped)
+      {
+        input->escaped = false;
+        current++;
+        continue;
+      }
+
+      current = string_special_char(current);
+      if (*current == '"')
+      {
+        input->in_string = false;
+      }
+      else if (*current == '\\')
+      {
+        input->escaped = true;
+      }
+      else if (*current == '\0')
+      {
+        break;
+      }
+      current++;
+      continue;
+    }
+
+    char chr = *current++;
+    if (input->slash)
+    {
+      input->slash = false;
+      if (chr == '/')
+      {
+        input->in_comment = true;
+        continue;
+      }
+    }
+
+    switch (chr)
+    {
+    case '"':
+      input->in_string = true;
+      break;
+    case '/':
+      input->slash = true;
+      break;
+    case '(':
+    case '{':
+    case '[':
+      input->depth++;
+      break;
+    case ')':
+    case '}':
+    case ']':
+      input->depth--;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+bool repl_input_is_complete(const ReplInput *input)
+{
+  // Too many closing brackets won't get better with more input - let the compiler report them.
+  return !input->in_string && input->depth <= 0;
+}
+
+// Transparent huge pages are 2 MiB on x86-64 and (usually) arm64.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static Token *arena_allocate(size_t bytes, bool huge_pages)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (huge_pages)
+  {
+    // Huge pages need huge page aligned memory, which mmap doesn't promise (Linux only aligns large anonymous mappings
+    // since 6.7). Map a huge page more than needed and unmap what's outside of the aligned range.
+    char *memory = mmap(NULL, bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+      exit(1);
+    }
+    char *aligned = (char *)(((uintptr_t)memory + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > memory)
+    {
+      munmap(memory, aligned - memory);
+    }
+    munmap(aligned + bytes, memory + HUGE_PAGE_SIZE - aligned);
+    madvise(aligned, bytes, MADV_HUGEPAGE); // Just advice - if THP is disabled, we get normal pages.
+    return (Token *)aligned;
+  }
+#else
+  (void)huge_pages;
+#endif
+
+  Token *memory = malloc(bytes);
+  if (memory == NULL)
+  {
+    exit(1);
+  }
+  return memory;
+}
+
+static void arena_release(Token *memory, size_t bytes, bool huge_pages)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (huge_pages)
+  {
+    munmap(memory, bytes);
+    return;
+  }
+#else
+  (void)bytes;
+  (void)huge_pages;
+#endif
+
+  free(memory);
+}
+
+void token_arena_init(TokenArena *arena, bool huge_pages)
+{
+  arena->tokens = NULL;
+  arena->count = 0;
+  arena->capacity = 0;
+  arena->huge_pages = huge_pages;
+}
+
+void token_arena_free(TokenArena *arena)
+{
+  if (arena->tokens != NULL)
+  {
+    arena_release(arena->tokens, sizeof(Token) * arena->capacity, arena->huge_pages);
+  }
+  token_arena_init(arena, arena->huge_pages);
+}
+
+void token_arena_reset(TokenArena *arena)
+{
+  arena->count = 0;
+}
+
+Token *token_arena_push(TokenArena *arena, Token token)
+{
+  if (arena->count == arena->capacity)
+  {
+    // Huge page backed arenas grow in whole huge pages, everything else doubles.
+    size_t bytes = sizeof(Token) * (arena->capacity < 1024 ? 1024 : arena->capacity * 2);
+    if (arena->huge_pages)
+    {
+      bytes = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+
+    Token *tokens = arena_allocate(bytes, arena->huge_pages);
+    if (arena->tokens != NULL)
+    {
+      memcpy(tokens, arena->tokens, sizeof(Token) * arena->count);
+      arena_release(arena->tokens, sizeof(Token) * arena->capacity, arena->huge_pages);
+    }
+    arena->tokens = tokens;
+    arena->capacity = (int)(bytes / sizeof(Token));
+  }
+
+  arena->tokens[arena->count] = token;
+  return &arena->tokens[arena->count++];
+}
+
+int token_arena_scan(TokenArena *arena)
+{
+  Scanner *scanner = &thread_scanner;
+  token_arena_reset(arena);
+  for (;;)
+  {
+    Token token = scan_token(scanner);
+    token_arena_push(arena, token);
+    if (token.type == TOKEN_EOF)
+    {
+      return arena->count;
+    }
+  }
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+// Key of the thread-local arenas, its destructor releases a thread's arena when the thread exits.
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void free_thread_arena(void *arena)
+{
+  token_arena_free(arena);
+  free(arena);
+}
+
+static void create_arena_key()
+{
+  if (pthread_key_create(&arena_key, free_thread_arena) != 0)
+  {
+    exit(1);
+  }
+}
+
+TokenArena *token_arena_get_thread_local()
+{
+  pthread_once(&arena_key_once, create_arena_key);
+  TokenArena *arena = pthread_getspecific(arena_key);
+  if (arena == NULL)
+  {
+    arena = malloc(sizeof(*arena));
+    if (arena == NULL || pthread_setspecific(arena_key, arena) != 0)
+    {
+      exit(1);
+    }
+    token_arena_init(arena, true);
+  }
+  return arena;
+}
+#else
+TokenArena *token_arena_get_thread_local()
+{
+  static _Thread_local TokenArena arena;
+  static _Thread_local bool initialized = false;
+  if (!initialized)
+  {
+    token_arena_init(&arena, true);
+    initialized = true;
+  }
+  return &arena;
+}
+#endif
+
+// TextMate scopes per token kind, matching what the theme colors. Indexed by TokenKind, so highlighters can resolve
+// a style for each kind once up front and then just index into their own table while rendering.
+static const char *token_scopes[TOKEN_EOF + 1] = {
+    [TOKEN_OR] = "keyword.operator.logical",
+    [TOKEN_AND] = "keyword.operator.logical",
+    [TOKEN_EQ] = "keyword.operator.comparison",
+    [TOKEN_NEQ] = "keyword.operator.comparison",
+    [TOKEN_GT] = "keyword.operator.comparison",
+    [TOKEN_LT] = "keyword.operator.comparison",
+    [TOKEN_GTEQ] = "keyword.operator.comparison",
+    [TOKEN_LTEQ] = "keyword.operator.comparison",
+    [TOKEN_PLUS] = "keyword.operator.arithmetic",
+    [TOKEN_MINUS] = "keyword.operator.arithmetic",
+    [TOKEN_MULT] = "keyword.operator.arithmetic",
+    [TOKEN_DIV] = "keyword.operator.arithmetic",
+    [TOKEN_MOD] = "keyword.operator.arithmetic",
+    [TOKEN_NOT] = "keyword.operator.logical",
+    [TOKEN_TERNARY] = "keyword.operator.ternary",
+
+    [TOKEN_PLUS_PLUS] = "keyword.operator.increment",
+    [TOKEN_MINUS_MINUS] = "keyword.operator.decrement",
+
+    [TOKEN_DOT] = "punctuation.accessor",
+    [TOKEN_DOTDOT] = "keyword.operator.range",
+    [TOKEN_DOTDOTDOT] = "keyword.operator.spread",
+    [TOKEN_COMMA] = "punctuation.separator",
+    [TOKEN_COLON] = "punctuation.separator",
+    [TOKEN_SCOLON] = "punctuation.terminator",
+    [TOKEN_ASSIGN] = "keyword.operator.assignment",
+    [TOKEN_OPAR] = "punctuation.section.parens",
+    [TOKEN_CPAR] = "punctuation.section.parens",
+    [TOKEN_OBRACE] = "punctuation.section.block",
+    [TOKEN_CBRACE] = "punctuation.section.block",
+    [TOKEN_OBRACK] = "punctuation.section.brackets",
+    [TOKEN_CBRACK] = "punctuation.section.brackets",
+
+    [TOKEN_PLUS_ASSIGN] = "keyword.operator.assignment.compound",
+    [TOKEN_MINUS_ASSIGN] = "keyword.operator.assignment.compound",
+    [TOKEN_MULT_ASSIGN] = "keyword.operator.assignment.compound",
+    [TOKEN_DIV_ASSIGN] = "keyword.operator.assignment.compound",
+    [TOKEN_MOD_ASSIGN] = "keyword.operator.assignment.compound",
+
+    [TOKEN_LAMBDA] = "storage.type.function.arrow",
+
+    [TOKEN_TRUE] = "constant.language",
+    [TOKEN_FALSE] = "constant.language",
+    [TOKEN_NIL] = "constant.language",
+    [TOKEN_IF] = "keyword.control",
+    [TOKEN_IMPORT] = "keyword.control.import",
+    [TOKEN_FROM] = "keyword.control.import",
+    [TOKEN_ELSE] = "keyword.control",
+    [TOKEN_WHILE] = "keyword.control",
+    [TOKEN_FOR] = "keyword.control",
+    [TOKEN_BREAK] = "keyword.control",
+    [TOKEN_SKIP] = "keyword.control",
+    [TOKEN_CLASS] = "storage.type.class",
+    [TOKEN_STATIC] = "storage.modifier",
+    [TOKEN_THIS] = "variable.language",
+    [TOKEN_PRINT] = "support.function",
+    [TOKEN_FN] = "storage.type.function",
+    [TOKEN_RETURN] = "keyword.control",
+    [TOKEN_LET] = "storage.type",
+    [TOKEN_CONST] = "storage.modifier",
+    [TOKEN_CTOR] = "storage.type.function",
+    [TOKEN_BASE] = "variable.language",
+    [TOKEN_TRY] = "keyword.control",
+    [TOKEN_THROW] = "keyword.control",
+    [TOKEN_CATCH] = "keyword.control",
+    [TOKEN_IS] = "keyword.operator.word",
+    [TOKEN_IN] = "keyword.operator.word",
+
+    [TOKEN_ID] = "variable",
+    [TOKEN_NUMBER] = "constant.numeric",
+    [TOKEN_STRING] = "string",
+    [TOKEN_OTHER] = "source",
+    [TOKEN_COMMENT] = "comment.line.double-slash",
+    [TOKEN_ERROR] = "invalid.illegal",
+    [TOKEN_EOF] = "source",
+};
+
+const char *scanner_token_scope(TokenKind type)
+{
+  return token_scopes[type];
+}
+
+static Token scan_token(Scanner *scanner)
+{
+  scanner->is_first_on_line = false;
+
+  skip_whitespace(scanner);
+  scanner->start = scanner->current;
+
+  if (is_at_end(scanner) || (scanner->chunk_end != NULL && scanner->start >= scanner->chunk_end))
+  {
+    return make_token(scanner, TOKEN_EOF);
+  }
+
+  char chr = advance(scanner);
 
   if (is_digit(chr))
   {
-    return number(chr);
+    return number(scanner, chr);
   }
 
   if (is_alpha(chr))
   {
-    return identifier();
+    return identifier(scanner);
   }
 
   switch (chr)
   {
   case '(':
-    return make_token(TOKEN_OPAR);
+    return make_token(scanner, TOKEN_OPAR);
   case ')':
-    return make_token(TOKEN_CPAR);
+    return make_token(scanner, TOKEN_CPAR);
   case '{':
-    return make_token(TOKEN_OBRACE);
+    return make_token(scanner, TOKEN_OBRACE);
   case '}':
-    return make_token(TOKEN_CBRACE);
+    return make_token(scanner, TOKEN_CBRACE);
   case '[':
-    return make_token(TOKEN_OBRACK);
+    return make_token(scanner, TOKEN_OBRACK);
   case ']':
-    return make_token(TOKEN_CBRACK);
+    return make_token(scanner, TOKEN_CBRACK);
   case '.':
-    return make_token(match('.') ? match('.') ? TOKEN_DOTDOTDOT : TOKEN_DOTDOT : TOKEN_DOT);
+    return make_token(scanner, match(scanner, '.') ? match(scanner, '.') ? TOKEN_DOTDOTDOT : TOKEN_DOTDOT : TOKEN_DOT);
   case ':':
-    return make_token(TOKEN_COLON);
+    return make_token(scanner, TOKEN_COLON);
   case ';':
-    return make_token(TOKEN_SCOLON);
+    return make_token(scanner, TOKEN_SCOLON);
   case ',':
-    return make_token(TOKEN_COMMA);
+    return make_token(scanner, TOKEN_COMMA);
   case '?':
-    return make_token(TOKEN_TERNARY);
+    return make_token(scanner, TOKEN_TERNARY);
 
   case '+':
-    return make_token(match('=') ? TOKEN_PLUS_ASSIGN : match('+') ? TOKEN_PLUS_PLUS
-                                                                  : TOKEN_PLUS);
+    return make_token(scanner, match(scanner, '=') ? TOKEN_PLUS_ASSIGN : match(scanner, '+') ? TOKEN_PLUS_PLUS
+                                                                                             : TOKEN_PLUS);
   case '-':
-    return make_token(match('>')   ? TOKEN_LAMBDA
-                      : match('-') ? TOKEN_MINUS_MINUS
-                      : match('=') ? TOKEN_MINUS_ASSIGN
-                                   : TOKEN_MINUS);
+    return make_token(scanner, match(scanner, '>')   ? TOKEN_LAMBDA
+                               : match(scanner, '-') ? TOKEN_MINUS_MINUS
+                               : match(scanner, '=') ? TOKEN_MINUS_ASSIGN
+                                                     : TOKEN_MINUS);
   case '/':
-    return make_token(match('=') ? TOKEN_DIV_ASSIGN : TOKEN_DIV);
+    // Only reachable when keeping comments, otherwise skip_whitespace already skipped them.
+    if (peek(scanner) == '/')
+    {
+      scanner->current = comment_end(scanner->current);
+      return make_token(scanner, TOKEN_COMMENT);
+    }
+    return make_token(scanner, match(scanner, '=') ? TOKEN_DIV_ASSIGN : TOKEN_DIV);
   case '*':
-    return make_token(match('=') ? TOKEN_MULT_ASSIGN : TOKEN_MULT);
+    return make_token(scanner, match(scanner, '=') ? TOKEN_MULT_ASSIGN : TOKEN_MULT);
   case '%':
-    return make_token(match('=') ? TOKEN_MOD_ASSIGN : TOKEN_MOD);
+    return make_token(scanner, match(scanner, '=') ? TOKEN_MOD_ASSIGN : TOKEN_MOD);
 
   case '=':
-    return make_token(match('=') ? TOKEN_EQ : TOKEN_ASSIGN);
+    return make_token(scanner, match(scanner, '=') ? TOKEN_EQ : TOKEN_ASSIGN);
   case '!':
-    return make_token(match('=') ? TOKEN_NEQ : TOKEN_NOT);
+    return make_token(scanner, match(scanner, '=') ? TOKEN_NEQ : TOKEN_NOT);
   case '<':
-    return make_token(match('=') ? TOKEN_LTEQ : TOKEN_LT);
+    return make_token(scanner, match(scanner, '=') ? TOKEN_LTEQ : TOKEN_LT);
   case '>':
-    return make_token(match('=') ? TOKEN_GTEQ : TOKEN_GT);
+    return make_token(scanner, match(scanner, '=') ? TOKEN_GTEQ : TOKEN_GT);
 
   case '"':
-    return string();
+    return string(scanner);
   }
 
-  return error_token("Unexpected character.");
+  return error_token(scanner, SCAN_ERROR_UNEXPECTED_CHAR);
+}
+
+Token scanner_scan_token()
+{
+  return scan_token(&thread_scanner);
 }
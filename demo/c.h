@@ -1,7 +1,13 @@
 #ifndef scanner_h
 #define scanner_h
 
+#ifndef __cplusplus
+#include <stdatomic.h> // For TokenQueue, which is C only.
+#endif
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 // Hexadecimal (base-16) digits can represent 4 bits each (since 16=2^4). Given the 53-bit precision of a
 // double, the longest hexadecimal literal that can fit without loss of precision would be 53/4=13.25 digits.
@@ -90,10 +96,11 @@ typedef enum
   TOKEN_IS,     // 'is'
   TOKEN_IN,     // 'in'
 
-  TOKEN_ID,     // [a-zA-Z_] [a-zA-Z_0-9]*
-  TOKEN_NUMBER, // [0-9]+  or [0-9]+ '.' [0-9]* | '.' [0-9]+
-  TOKEN_STRING, // '"' (~["\r\n] | '""')* '"'
-  TOKEN_OTHER,  // .
+  TOKEN_ID,      // [a-zA-Z_] [a-zA-Z_0-9]*
+  TOKEN_NUMBER,  // [0-9]+  or [0-9]+ '.' [0-9]* | '.' [0-9]+
+  TOKEN_STRING,  // '"' (~["\r\n] | '""')* '"'
+  TOKEN_OTHER,   // .
+  TOKEN_COMMENT, // '//' ~[\n]*, only when keeping comments
   TOKEN_ERROR,
   TOKEN_EOF
 } TokenKind;
@@ -108,13 +115,375 @@ typedef struct
   bool is_first_on_line;
 } Token;
 
+// Number of tokens per batch passed from the scanner thread to the compiler thread. Big enough to make the per-batch
+// synchronization negligible, small enough for a batch to stay in L1.
+#define TOKEN_BATCH_SIZE 256
+
+// Number of batches the scanner thread can be ahead of the compiler thread.
+#define TOKEN_QUEUE_BATCHES 8
+
+typedef struct
+{
+  Token tokens[TOKEN_BATCH_SIZE];
+  int count;
+} TokenBatch;
+
+#ifndef __cplusplus
+// Lock-free single-producer/single-consumer queue of token batches. Head and tail live on separate cache lines, so
+// the producer and consumer don't contend for them. Built on C11 atomics, so it's not available to C++ includers.
+typedef struct
+{
+  TokenBatch batches[TOKEN_QUEUE_BATCHES];
+  const char *source; // Source being scanned, for position lookups on the consumer's side. Set by scanner_fill_queue.
+  _Alignas(64) atomic_size_t head; // Next batch to consume. Written by the consumer only.
+  _Alignas(64) atomic_size_t tail; // Next batch to produce. Written by the producer only.
+} TokenQueue;
+#endif
+
+// Hash of a top-level `fn` or `cls` declaration's tokens, or of a method or `ctor` of a top-level class.
+typedef struct
+{
+  Token name;    // The declared name, or the `ctor` keyword.
+  uint32_t hash; // Hash over the kind and lexeme of every token, from the name to the end of the declaration.
+  int parent;    // Index of the class declaring this method or `ctor`, -1 for top-level declarations.
+} DeclarationHash;
+
+typedef enum
+{
+  OUTLINE_CLASS,         // 'cls' Name
+  OUTLINE_FN,            // 'fn' name, top-level
+  OUTLINE_METHOD,        // 'fn' name, in a class
+  OUTLINE_STATIC_METHOD, // 'static' 'fn' name, in a class
+  OUTLINE_CTOR,          // 'ctor', in a class
+  OUTLINE_LET,           // 'let' name, top-level
+  OUTLINE_CONST,         // 'const' name, top-level
+  OUTLINE_IMPORT,        // 'import' name
+} OutlineKind;
+
+// A symbol of a document's outline.
+typedef struct
+{
+  OutlineKind kind;
+  Token name; // The declared name, or the 'ctor' keyword for constructors.
+} OutlineSymbol;
+
+// An unbalanced bracket pair. Both are token indices, -1 if there is no such bracket.
+typedef struct
+{
+  int open;  // The opening bracket.
+  int close; // The closing bracket. If both are set, the brackets are of different kinds.
+} BracketMismatch;
+
+// Run-length encoded line table. Maps offsets (e.g. into bytecode) to source lines, but only stores an entry where the
+// line changes, instead of one line per offset.
+typedef struct
+{
+  int count;
+  int capacity;
+  int *offsets; // First offset of each run, ascending.
+  int *lines;   // Line of each run.
+} LineTable;
+
+// Where every line of a source starts, for converting between byte offsets and LSP positions without walking the
+// source. Lines that are pure ASCII are flagged, their UTF-16 columns are just byte columns.
+typedef struct
+{
+  const char *source;
+  int count; // Number of lines, at least one.
+  int capacity;
+  int *starts; // Offset of each line's first character, ascending. One more entry marks the end of the last line.
+  bool *ascii; // Whether each line is pure ASCII.
+} LineIndex;
+
+// A position as LSP counts it: zero-based line, and column in UTF-16 code units.
+typedef struct
+{
+  int line;
+  int column;
+} LspPosition;
+
+typedef enum
+{
+  SCAN_ERROR_UNTERMINATED_STRING, // '"' without a closing '"'
+  SCAN_ERROR_HEX_LITERAL,         // '0x' with no digits or more than MAX_HEX_DIGITS
+  SCAN_ERROR_BINARY_LITERAL,      // '0b' with no digits or more than MAX_BINARY_DIGITS
+  SCAN_ERROR_OCTAL_LITERAL,       // '0o' with no digits or more than MAX_OCTAL_DIGITS
+  SCAN_ERROR_UNEXPECTED_CHAR,     // A character that doesn't start any token
+} ScanErrorCode;
+
+// A lexical error. Unlike the TOKEN_ERROR token (which points to the message), this points to the offending source.
+typedef struct
+{
+  ScanErrorCode code;
+  const char *start; // The offending source, e.g. a string literal from its opening quote up to the end of the source.
+  int length;
+  int line; // The line `start` is on, even if the span runs over several.
+} ScanError;
+
+// Upper bounds for the k-gram length and window size of scanner_winnow.
+#define WINNOW_MAX_K 64
+#define WINNOW_MAX_WINDOW 64
+
+// A winnowing fingerprint of a token stream.
+typedef struct
+{
+  uint32_t hash; // Hash of the normalized k-gram.
+  int token;     // Index of the k-gram's first token.
+} Fingerprint;
+
+// Size metrics of a source, or of many sources added up.
+typedef struct
+{
+  long lines;                 // Physical lines.
+  long code_lines;            // Lines with tokens on them. Multi-line strings count for every line they span.
+  long comment_lines;         // Lines with nothing but a comment.
+  long blank_lines;           // Lines with nothing but whitespace.
+  long string_bytes;          // Size of all string literals, including their quotes.
+  long number_bytes;          // Size of all number literals.
+  long tokens[TOKEN_EOF + 1]; // Number of tokens per kind.
+} SourceMetrics;
+
+// Position of a decoded token in its original source.
+typedef struct
+{
+  int offset; // Byte offset from the start of the source.
+  int column; // Byte column, 0-based.
+} TokenPosition;
+
+// Reusable token storage for batch tools that scan many files. Resetting keeps the memory, so after the first few files
+// scanning doesn't allocate anymore. Optionally backed by transparent huge pages, to cut page faults and TLB misses.
+typedef struct
+{
+  Token *tokens;
+  int count;
+  int capacity;
+  bool huge_pages;
+} TokenArena;
+
+// Lexical state of REPL input that is appended to line by line, to tell whether it's complete without rescanning it.
+typedef struct
+{
+  int depth;       // Number of open parens, braces and brackets.
+  bool in_string;  // Inside a string literal.
+  bool in_comment; // Inside a line comment.
+  bool escaped;    // The last character was a backslash inside a string literal.
+  bool slash;      // The last character was a slash, which might start a comment.
+} ReplInput;
+
 // Initialize the scanner with the source code.
 void scanner_init(const char *source);
 
 // Scan and return the next token.
 Token scanner_scan_token();
 
-// Get the start of a line of a token, exclusive (points to the first character of the line).
+// Return comments as TOKEN_COMMENT tokens instead of skipping them, e.g. for a formatter which has to re-emit them. Off
+// by default, call after initializing the scanner.
+void scanner_keep_comments(bool keep);
+
+// Scan long comments, string literals, indentation and numbers with plain byte loops instead of libc's CPU-specific
+// routines, e.g. to benchmark or test against them. Applies to all threads, set it before scanning. Which of libc's
+// variants runs is up to libc - glibc lets its tunables (glibc.cpu.hwcaps) mask CPU features to pin one.
+void scanner_force_scalar(bool scalar);
+
+// Initialize the scanner to resume scanning `source` at `position`, which is on `line`. E.g. to compile a function body
+// that was skipped with scanner_skip_block, starting right after its opening brace.
+void scanner_init_at(const char *source, const char *position, int line);
+
+// Skip the rest of a block, right after its opening brace was scanned. Only balances braces - stepping over strings and
+// comments - without classifying keywords or building tokens. Returns the closing brace token, or the EOF token if the
+// block is never closed. Scanning continues after the closing brace, with the line count up to date.
+Token scanner_skip_block();
+
+// Get the error behind the last TOKEN_ERROR token that was scanned.
+ScanError scanner_get_last_error();
+
+// Get the message of an error code, the same one that the TOKEN_ERROR token carries.
+const char *scanner_get_error_message(ScanErrorCode code);
+
+// Scan the whole source and record every lexical error instead of stopping at the first one, e.g. for a lint pass.
+// Returns the number of errors found, only the first `capacity` of which are written to `errors`.
+int scanner_lint(ScanError *errors, int capacity);
+
+// Scan the whole source and collect its metrics.
+void scanner_scan_metrics(SourceMetrics *metrics);
+
+// Add `metrics` to `total`, e.g. to get the metrics of a directory from its files.
+void metrics_add(SourceMetrics *total, const SourceMetrics *metrics);
+
+// Write metrics as a single line of JSON, labeled with `path`.
+void metrics_write_json(FILE *file, const char *path, const SourceMetrics *metrics);
+
+// Initialize the scanner to scan a chunk of a larger source. The chunk must start at the beginning of the source or
+// right after a newline, and `line` is the line it starts on. Only tokens starting before `chunk_end` are returned,
+// tokens crossing it (multi-line strings) are scanned to their end. Pass NULL as `chunk_end` for the last chunk.
+//
+// Scanning a huge source in parallel: each thread scans its chunk twice, once as-is and once after calling
+// scanner_scan_string_tail, in case it starts inside a string literal. Then, going through the chunks in order, a chunk
+// starts inside a string if scanner_chunk_ends_in_string was true after the previous chunk's picked scan. If so, pick
+// the string-tail scan and drop its first token (the previous chunk already scanned the whole string), otherwise pick
+// the as-is scan. Concatenating the picked scans without their EOF tokens (except for the last one) gives exactly the
+// tokens of a serial scan.
+void scanner_init_chunk(const char *source, const char *chunk_start, const char *chunk_end, int line);
+
+// Scan the remainder of a string literal that a chunk starts in. Call right after scanner_init_chunk.
+Token scanner_scan_string_tail();
+
+// Whether the last token of the scanned chunk runs past its end, which means that the next chunk starts inside of a
+// string literal. Valid once the chunk's EOF token has been scanned.
+bool scanner_chunk_ends_in_string();
+
+// Scan up to `capacity` tokens into `tokens`, stopping after the EOF token. Returns the number of tokens scanned.
+int scanner_scan_batch(Token *tokens, int capacity);
+
+#ifndef __cplusplus
+// Initialize an empty token queue.
+void token_queue_init(TokenQueue *queue);
+
+// Get the next batch to fill, or NULL if the queue is full. Producer only.
+TokenBatch *token_queue_reserve(TokenQueue *queue);
+
+// Hand the reserved batch to the consumer. Producer only.
+void token_queue_publish(TokenQueue *queue);
+
+// Get the next batch to consume, or NULL if the queue is empty. Consumer only.
+TokenBatch *token_queue_peek(TokenQueue *queue);
+
+// Give the consumed batch back to the producer. Consumer only.
+void token_queue_release(TokenQueue *queue);
+
+// Get the next batch to consume, waiting for the producer if the queue is empty. Polls with a pause first and then
+// yields the core, like the producer does when the queue is full. Consumer only.
+TokenBatch *token_queue_wait(TokenQueue *queue);
+
+// Scan the whole source into the queue, batch by batch. Meant to run on its own thread, while the compiler consumes the
+// batches on another. Call scanner_init on the scanning thread first, since the scanner state is thread-local. The
+// last batch ends with the EOF token. Backs off like token_queue_wait while the queue is full. The consumer has its own
+// scanner state, so it looks up lines with scanner_get_line_start_at(queue->source, ...).
+void scanner_fill_queue(TokenQueue *queue);
+#endif
+
+// Scan the whole source and hash each top-level `fn` and `cls` declaration, and each method and `ctor` of those
+// classes. Comparing the hashes with the ones from the previous build tells which declarations actually changed - edits
+// to whitespace and comments, or to code outside of a declaration, don't change its hash. A class's hash leaves out its
+// methods, which have their own. A declaration ends with its closing brace. A bodiless class ends with its header (its
+// name and `: Base`). A function without a braced body ends where the next declaration starts or, after `->`, at the
+// next line outside of parens and brackets.
+// Returns the number of declarations found, only the first `capacity` of which are written to `hashes`.
+int scanner_hash_declarations(DeclarationHash *hashes, int capacity);
+
+// Scan the whole source, but only extract its outline: classes and their members, top-level functions and variables
+// and imports. Function bodies are skipped with scanner_skip_block. Returns the number of symbols found, only the first
+// `capacity` of which are written to `symbols`.
+int scanner_scan_outline(OutlineSymbol *symbols, int capacity);
+
+// Compute the winnowing fingerprints of `tokens` for clone detection. Tokens are normalized to their kind, so code that
+// only differs in names or literal values gets the same fingerprints. Every run of `k` tokens is hashed and the minimum
+// hash of each window of `w` consecutive k-grams is selected, which guarantees that any clone of at least w + k - 1
+// tokens shares a fingerprint. Returns the number of fingerprints, only the first `capacity` of which are written.
+int scanner_winnow(const Token *tokens, int count, int k, int w, Fingerprint *fingerprints, int capacity);
+
+// Pair up the parens, braces and brackets of `tokens` (e.g. a batch right after scanning it) in one pass. Afterwards,
+// `partners[i]` is the index of the bracket pairing with `tokens[i]`, or -1 for unbalanced brackets and all other
+// tokens. Unbalanced brackets are also written to `mismatches`. Returns the number of mismatches found, only the first
+// `capacity` of which are written.
+int scanner_pair_brackets(const Token *tokens, int count, int *partners, BracketMismatch *mismatches, int capacity);
+
+// Encode the tokens of a source into a pre-tokenized module, which loads without scanning and is smaller than the
+// source. Lexemes are stored once in a dictionary, positions as varint deltas - or not at all, for tokens one space
+// after the previous one. Comments are dropped. Returns the module (owned by the caller, free it) and its size, or NULL
+// if the source has lexical errors.
+uint8_t *token_module_encode(const char *source, size_t *size);
+
+// Whether `data` is a pre-tokenized module rather than source code, so loaders can accept either.
+bool token_module_is_encoded(const uint8_t *data, size_t size);
+
+// Get the number of tokens (including EOF) in a pre-tokenized module, or -1 if it's malformed.
+int token_module_count_tokens(const uint8_t *data, size_t size);
+
+// Decode a pre-tokenized module into `tokens` and their source `positions`. Token lexemes point into `data`, which must
+// outlive them. Lines and positions are exactly those of the original source. Returns the number of tokens, or -1 if
+// the module is malformed or has more than `capacity` tokens.
+int token_module_decode(const uint8_t *data, size_t size, Token *tokens, TokenPosition *positions, int capacity);
+
+// Initialize an empty line table.
+void line_table_init(LineTable *table);
+
+// Free a line table's storage and reset it to empty.
+void line_table_free(LineTable *table);
+
+// Record that `offset` belongs to `line` (e.g. the line of the token it was emitted for). Offsets must be added in
+// ascending order.
+void line_table_add(LineTable *table, int offset, int line);
+
+// Get the line of an offset, or -1 if the table is empty. O(log runs).
+int line_table_get(const LineTable *table, int offset);
+
+// Initialize an empty token arena. With `huge_pages`, memory is requested in huge page multiples and marked for
+// transparent huge pages (Linux only, elsewhere it's ignored).
+void token_arena_init(TokenArena *arena, bool huge_pages);
+
+// Free a token arena's memory and reset it to empty.
+void token_arena_free(TokenArena *arena);
+
+// Empty the arena, keeping its memory for the next file.
+void token_arena_reset(TokenArena *arena);
+
+// Append a token to the arena. Returns the stored token, which stays valid until the arena grows or is reset.
+Token *token_arena_push(TokenArena *arena, Token token);
+
+// Reset the arena and scan the whole source into it. Returns the number of tokens, including EOF.
+int token_arena_scan(TokenArena *arena);
+
+// Get the calling thread's own huge page backed arena, so parallel drivers don't contend on the allocator. Lives as
+// long as the thread, reset it between files. Its memory is released when the thread exits - except without POSIX
+// threads, where the thread has to call token_arena_free on it before exiting.
+TokenArena *token_arena_get_thread_local();
+
+// Initialize the state of empty REPL input.
+void repl_input_init(ReplInput *input);
+
+// Update the state with appended input. Only looks at the new text, so it's O(length of `text`).
+void repl_input_append(ReplInput *input, const char *text);
+
+// Whether the input so far is complete, i.e. has no pending string and no unclosed brackets.
+bool repl_input_is_complete(const ReplInput *input);
+
+// Get the start of a line of a token, exclusive (points to the first character of the line). The token must come
+// from the source this thread's scanner was initialized with.
 const char *scanner_get_line_start(Token token);
 
+// Get the start of the line `position` is on, in `source`. Works on any thread, e.g. for tokens scanned on another
+// one or for ScanError.start.
+const char *scanner_get_line_start_at(const char *source, const char *position);
+
+// Get the column of a token in UTF-16 code units, which is how LSP positions count. Lines are checked for pure ASCII
+// eight bytes at a time, so it's cheap for the common case. Returns -1 for error tokens, whose start points to their
+// message - use scanner_get_utf16_column_at with ScanError.start for those.
+int scanner_get_utf16_column(Token token);
+
+// Get the column of `position` in `source` in UTF-16 code units, e.g. for ScanError.start or tokens scanned on another
+// thread.
+int scanner_get_utf16_column_at(const char *source, const char *position);
+
+// Get the position of a UTF-16 column (e.g. from an LSP position) on the line starting at `line_start`. Columns past
+// the end of the line are clamped to it.
+const char *scanner_get_utf16_position(const char *line_start, int column);
+
+// Index the lines of `source` in a single pass. Rebuild it when the source changes.
+void line_index_init(LineIndex *index, const char *source);
+
+// Free a line index's storage.
+void line_index_free(LineIndex *index);
+
+// Get the LSP position of a byte offset. O(log lines), plus a walk over the line up to the offset unless the line is
+// pure ASCII.
+LspPosition line_index_get_position(const LineIndex *index, int offset);
+
+// Get the byte offset of an LSP position. Lines past the end are clamped to the last line, columns past the end of a
+// line to its end. O(1), plus a walk over the line up to the column unless the line is pure ASCII.
+int line_index_get_offset(const LineIndex *index, LspPosition position);
+
+// Get the TextMate scope of a token kind (e.g. "keyword.control"), as used by the theme's token colors.
+const char *scanner_token_scope(TokenKind type);
+
 #endif
@@ -0,0 +1,131 @@
+// Generated by dev/keywords.ts for the 'slang' dialect - do not edit.
+// Included by the scanner, relies on its check_keyword() and scanner state.
+
+static TokenKind identifier_type(Scanner *scanner)
+{
+  switch (scanner->start[0])
+  {
+  case 'a':
+    return check_keyword(scanner, 1, 2, "nd", TOKEN_AND);
+  case 'b':
+    if (scanner->current - scanner->start > 1)
+    {
+      switch (scanner->start[1])
+      {
+      case 'a':
+        return check_keyword(scanner, 2, 2, "se", TOKEN_BASE);
+      case 'r':
+        return check_keyword(scanner, 2, 3, "eak", TOKEN_BREAK);
+      }
+    }
+    break;
+  case 'c':
+    if (scanner->current - scanner->start > 1)
+    {
+      switch (scanner->start[1])
+      {
+      case 'a':
+        return check_keyword(scanner, 2, 3, "tch", TOKEN_CATCH);
+      case 'l':
+        return check_keyword(scanner, 2, 1, "s", TOKEN_CLASS);
+      case 'o':
+        return check_keyword(scanner, 2, 3, "nst", TOKEN_CONST);
+      case 't':
+        return check_keyword(scanner, 2, 2, "or", TOKEN_CTOR);
+      }
+    }
+    break;
+  case 'e':
+    return check_keyword(scanner, 1, 3, "lse", TOKEN_ELSE);
+  case 'f':
+    if (scanner->current - scanner->start > 1)
+    {
+      switch (scanner->start[1])
+      {
+      case 'a':
+        return check_keyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+      case 'n':
+        return check_keyword(scanner, 2, 0, "", TOKEN_FN);
+      case 'o':
+        return check_keyword(scanner, 2, 1, "r", TOKEN_FOR);
+      case 'r':
+        return check_keyword(scanner, 2, 2, "om", TOKEN_FROM);
+      }
+    }
+    break;
+  case 'i':
+    if (scanner->current - scanner->start > 1)
+    {
+      switch (scanner->start[1])
+      {
+      case 'f':
+        return check_keyword(scanner, 2, 0, "", TOKEN_IF);
+      case 'm':
+        return check_keyword(scanner, 2, 4, "port", TOKEN_IMPORT);
+      case 'n':
+        return check_keyword(scanner, 2, 0, "", TOKEN_IN);
+      case 's':
+        return check_keyword(scanner, 2, 0, "", TOKEN_IS);
+      }
+    }
+    break;
+  case 'l':
+    return check_keyword(scanner, 1, 2, "et", TOKEN_LET);
+  case 'n':
+    return check_keyword(scanner, 1, 2, "il", TOKEN_NIL);
+  case 'o':
+    return check_keyword(scanner, 1, 1, "r", TOKEN_OR);
+  case 'p':
+    return check_keyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+  case 'r':
+    return check_keyword(scanner, 1, 2, "et", TOKEN_RETURN);
+  case 's':
+    if (scanner->current - scanner->start > 1)
+    {
+      switch (scanner->start[1])
+      {
+      case 'k':
+        return check_keyword(scanner, 2, 2, "ip", TOKEN_SKIP);
+      case 't':
+        return check_keyword(scanner, 2, 4, "atic", TOKEN_STATIC);
+      }
+    }
+    break;
+  case 't':
+    if (scanner->current - scanner->start > 1)
+    {
+      switch (scanner->start[1])
+      {
+      case 'h':
+        if (scanner->current - scanner->start > 2)
+        {
+          switch (scanner->start[2])
+          {
+          case 'i':
+            return check_keyword(scanner, 3, 1, "s", TOKEN_THIS);
+          case 'r':
+            return check_keyword(scanner, 3, 2, "ow", TOKEN_THROW);
+          }
+        }
+        break;
+      case 'r':
+        if (scanner->current - scanner->start > 2)
+        {
+          switch (scanner->start[2])
+          {
+          case 'u':
+            return check_keyword(scanner, 3, 1, "e", TOKEN_TRUE);
+          case 'y':
+            return check_keyword(scanner, 3, 0, "", TOKEN_TRY);
+          }
+        }
+        break;
+      }
+    }
+    break;
+  case 'w':
+    return check_keyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+  }
+
+  return TOKEN_ID;
+}
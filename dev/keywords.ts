@@ -0,0 +1,102 @@
+// Generates the scanner's keyword dispatch (`identifier_type()` in ../demo/keywords.h) from the keyword table below. The
+// generated code is the same hand-tuned trie of switches the scanner always used, so dialects don't fall back to a runtime
+// lookup. Dialects add or remove keywords - added ones need their TokenKind in the scanner header.
+// Run with `../dev $ deno run --allow-write keywords.ts [dialect] [output]`
+const keywords: Record<string, string> = {
+  and: 'TOKEN_AND',
+  base: 'TOKEN_BASE',
+  break: 'TOKEN_BREAK',
+  catch: 'TOKEN_CATCH',
+  cls: 'TOKEN_CLASS',
+  const: 'TOKEN_CONST',
+  ctor: 'TOKEN_CTOR',
+  else: 'TOKEN_ELSE',
+  false: 'TOKEN_FALSE',
+  fn: 'TOKEN_FN',
+  for: 'TOKEN_FOR',
+  from: 'TOKEN_FROM',
+  if: 'TOKEN_IF',
+  import: 'TOKEN_IMPORT',
+  in: 'TOKEN_IN',
+  is: 'TOKEN_IS',
+  let: 'TOKEN_LET',
+  nil: 'TOKEN_NIL',
+  or: 'TOKEN_OR',
+  print: 'TOKEN_PRINT',
+  ret: 'TOKEN_RETURN',
+  skip: 'TOKEN_SKIP',
+  static: 'TOKEN_STATIC',
+  this: 'TOKEN_THIS',
+  throw: 'TOKEN_THROW',
+  true: 'TOKEN_TRUE',
+  try: 'TOKEN_TRY',
+  while: 'TOKEN_WHILE',
+};
+
+type Dialect = { add?: Record<string, string>; remove?: string[] };
+
+const dialects: Record<string, Dialect> = {
+  slang: {},
+  'no-print': { remove: ['print'] },
+};
+
+const [dialectName = 'slang', output = './../demo/keywords.h'] = Deno.args;
+const dialect = dialects[dialectName];
+if (!dialect) {
+  throw new Error(`Unknown dialect '${dialectName}', expected one of: ${Object.keys(dialects).join(', ')}`);
+}
+
+const table = { ...keywords, ...dialect.add };
+(dialect.remove ?? []).forEach(keyword => delete table[keyword]);
+
+const indent = (level: number) => '  '.repeat(level);
+
+// Emits the cases for all keywords sharing the first `depth` characters, switching on the next character.
+const generateSwitch = (words: string[], depth: number, level: number): string[] => {
+  const groups = new Map<string, string[]>();
+  words
+    .filter(word => word.length > depth)
+    .sort()
+    .forEach(word => groups.set(word[depth], [...(groups.get(word[depth]) ?? []), word]));
+
+  const lines = [`${indent(level)}switch (scanner->start[${depth}])`, `${indent(level)}{`];
+  groups.forEach((group, chr) => {
+    lines.push(`${indent(level)}case '${chr}':`);
+    lines.push(...generateNode(group, depth + 1, level + 1));
+  });
+  lines.push(`${indent(level)}}`);
+  return lines;
+};
+
+// Emits the code for all keywords sharing the first `depth` characters.
+const generateNode = (words: string[], depth: number, level: number): string[] => {
+  if (words.length === 1) {
+    const [word] = words;
+    const rest = word.slice(depth);
+    return [`${indent(level)}return check_keyword(scanner, ${depth}, ${rest.length}, "${rest}", ${table[word]});`];
+  }
+
+  const lines: string[] = [];
+  const exact = words.find(word => word.length === depth);
+  if (exact) {
+    lines.push(`${indent(level)}if (scanner->current - scanner->start == ${depth})`, `${indent(level)}{`);
+    lines.push(`${indent(level + 1)}return ${table[exact]};`, `${indent(level)}}`);
+  }
+  lines.push(`${indent(level)}if (scanner->current - scanner->start > ${depth})`, `${indent(level)}{`);
+  lines.push(...generateSwitch(words, depth, level + 1));
+  lines.push(`${indent(level)}}`, `${indent(level)}break;`);
+  return lines;
+};
+
+const header = `// Generated by dev/keywords.ts for the '${dialectName}' dialect - do not edit.
+// Included by the scanner, relies on its check_keyword() and scanner state.
+
+static TokenKind identifier_type(Scanner *scanner)
+{
+${generateSwitch(Object.keys(table), 0, 1).join('\n')}
+
+  return TOKEN_ID;
+}
+`;
+
+await Deno.writeTextFile(output, header);